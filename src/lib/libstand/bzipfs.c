@@ -31,22 +31,72 @@
 
 #include <sys/stat.h>
 #include <string.h>
-#include <bzlib.h>
+#include "libstand_bzlib_private.h"
 
 #define BZ_BUFSIZE 2048	/* XXX larger? */
 
+/*
+ * Seek index.  bzip2 blocks are compressed independently, so we can
+ * restart decompression at any block header given its bit offset and
+ * the combined CRC of the blocks before it.  We find block headers by
+ * scanning the compressed data for the 48 bit block magic as we read
+ * it.  Once the decompressor is decoding block n we pair the last
+ * header seen with the output offset block n starts at and add both
+ * to the index; the block's CRC is kept to check that what we found
+ * really was the header when we restart there.
+ */
+#define BZ_BLOCK_MAGIC	0x314159265359ULL
+#define BZ_NCAND	4
+#define BZ_DISCARDSIZE	(32 * 1024)
+
+struct bz_point
+{
+    off_t		bp_out;		/* uncompressed offset of block */
+    off_t		bp_bit;		/* compressed bit offset of header */
+    UInt32		bp_crc;		/* combined CRC of earlier blocks */
+    UInt32		bp_blockcrc;	/* CRC of this block */
+    int			bp_block;	/* block number */
+    u_char		bp_byte;	/* the byte bp_bit is in */
+};
+
+struct bz_cand
+{
+    off_t		bc_bit;
+    u_char		bc_byte;
+};
+
+struct bz_index
+{
+    struct bz_point	*bi_points;
+    int			bi_npoints;
+    int			bi_maxpoints;
+    int			bi_level;	/* block size from the header */
+};
+
 struct bz_file
 {
     int			bzf_rawfd;
+    off_t		bzf_rawoffset;	/* where bzf_buf's contents end */
     bz_stream		bzf_bzstream;
     char		bzf_buf[BZ_BUFSIZE];
     int			bzf_endseen;
+    struct bz_index	bzf_index;
+    u_int64_t		bzf_scanreg;	/* last 8 bytes read */
+    struct bz_cand	bzf_cand[BZ_NCAND];
+    int			bzf_ncand;
+    char		*bzf_discard;	/* skip buffer for forward seeks */
+    char		*bzf_mem;	/* whole file, see bzf_loadmem() */
+    off_t		bzf_memsize;
+    off_t		bzf_mempos;
 };
 
 /* prototype in bzlib_private.h */
 void bz_internal_error(int errorcode);
 
 static int	bzf_fill(struct bz_file *z);
+static void	bzf_scan(struct bz_file *bzf, u_char *p, int len);
+static int	bzf_loadmem(struct open_file *f);
+static int	bzf_rewind(struct open_file *f, struct bz_point *bp);
 static int	bzf_open(const char *path, struct open_file *f);
 static int	bzf_close(struct open_file *f);
 static int	bzf_read(struct open_file *f, void *buf, size_t size, size_t *resid);
@@ -82,12 +132,103 @@ bzf_fill(struct bz_file *bzf)
 	/* read to fill buffer and update availibility data */
 	result = read(bzf->bzf_rawfd, bzf->bzf_buf + bzf->bzf_bzstream.avail_in, req);
 	bzf->bzf_bzstream.next_in = bzf->bzf_buf;
-	if (result >= 0)
+	if (result > 0) {
+	    bzf_scan(bzf, bzf->bzf_buf + bzf->bzf_bzstream.avail_in, result);
 	    bzf->bzf_bzstream.avail_in += result;
+	    bzf->bzf_rawoffset += result;
+	}
     }
     return(result);
 }
 
+/*
+ * Look for block headers in (len) bytes just read into (p).  Data before
+ * the last indexed block has been scanned already.
+ */
+static void
+bzf_scan(struct bz_file *bzf, u_char *p, int len)
+{
+    struct bz_index	*bi = &bzf->bzf_index;
+    struct bz_cand	*bc;
+    u_int64_t		reg;
+    off_t		n, bit;
+    int			sh;
+
+    n = bzf->bzf_rawoffset;
+    if (bi->bi_npoints > 0 &&
+	(n + len) * 8 <= bi->bi_points[bi->bi_npoints - 1].bp_bit + 48)
+	return;
+
+    reg = bzf->bzf_scanreg;
+    for (; len > 0; len--, p++, n++) {
+	reg = (reg << 8) | *p;
+	for (sh = 0; sh < 8; sh++) {
+	    if (((reg >> sh) & 0xffffffffffffULL) != BZ_BLOCK_MAGIC)
+		continue;
+	    bit = n * 8 - 40 - sh;
+	    bc = &bzf->bzf_cand[bzf->bzf_ncand++ % BZ_NCAND];
+	    bc->bc_bit = bit;
+	    bc->bc_byte = reg >> (8 * (n - bit / 8));
+	}
+    }
+    bzf->bzf_scanreg = reg;
+}
+
+/*
+ * Called after each decompression pass: if the decompressor has just got
+ * into a block we haven't indexed yet, add it.
+ */
+static void
+bzf_addpoint(struct bz_file *bzf)
+{
+    struct bz_index	*bi = &bzf->bzf_index;
+    DState		*ds = bzf->bzf_bzstream.state;
+    struct bz_point	*bp;
+    struct bz_cand	*bc;
+    off_t		pos, last;
+    int			i;
+
+    if (ds->state <= BZ_X_BCRC_4 || ds->state >= BZ_X_ENDHDR_2)
+	return;
+    last = -1;
+    if (bi->bi_npoints > 0) {
+	bp = &bi->bi_points[bi->bi_npoints - 1];
+	if (ds->currBlockNo <= bp->bp_block)
+	    return;
+	last = bp->bp_bit;
+    }
+
+    /* The header is the latest candidate we have fully consumed */
+    pos = (bzf->bzf_rawoffset - bzf->bzf_bzstream.avail_in) * 8 - ds->bsLive;
+    bc = NULL;
+    for (i = 0; i < BZ_NCAND && i < bzf->bzf_ncand; i++) {
+	struct bz_cand *c = &bzf->bzf_cand[(bzf->bzf_ncand - 1 - i) % BZ_NCAND];
+
+	if (c->bc_bit + 80 <= pos) {
+	    bc = c;
+	    break;
+	}
+    }
+    if (bc == NULL || bc->bc_bit <= last)
+	return;
+
+    if (bi->bi_npoints == bi->bi_maxpoints) {
+	i = bi->bi_maxpoints ? bi->bi_maxpoints * 2 : 32;
+	if ((bp = realloc(bi->bi_points, i * sizeof(*bp))) == NULL)
+	    return;
+	bi->bi_points = bp;
+	bi->bi_maxpoints = i;
+    }
+    bp = &bi->bi_points[bi->bi_npoints++];
+    bp->bp_out = ((off_t)bzf->bzf_bzstream.total_out_hi32 << 32) |
+	bzf->bzf_bzstream.total_out_lo32;
+    bp->bp_bit = bc->bc_bit;
+    bp->bp_crc = ds->calculatedCombinedCRC;
+    bp->bp_blockcrc = ds->storedBlockCRC;
+    bp->bp_block = ds->currBlockNo;
+    bp->bp_byte = bc->bc_byte;
+}
+
 /*
  * Adapted from get_byte/check_header in libz
  *
@@ -121,6 +262,7 @@ check_header(struct bz_file *bzf)
     c = get_byte(bzf);
     if (c < '1' || c > '9')
 	return(1);
+    bzf->bzf_index.bi_level = c;
 
     /* Put back bytes that we've took from the input stream */
     bzf->bzf_bzstream.next_in -= 4;
@@ -195,6 +337,10 @@ bzf_open(const char *fname, struct open_file *f)
 
     /* Looks OK, we'll take it */
     f->f_fsdata = bzf;
+    if ((error = bzf_loadmem(f)) != 0) {
+	bzf_close(f);
+	return(error);
+    }
     return(0);
 }
 
@@ -207,17 +353,97 @@ bzf_close(struct open_file *f)
     if (bzf) {
 	BZ2_bzDecompressEnd(&(bzf->bzf_bzstream));
 	close(bzf->bzf_rawfd);
+	if (bzf->bzf_index.bi_points != NULL)
+	    free(bzf->bzf_index.bi_points);
+	if (bzf->bzf_discard != NULL)
+	    free(bzf->bzf_discard);
+	if (bzf->bzf_mem != NULL)
+	    free(bzf->bzf_mem);
 	free(bzf);
     }
     return(0);
 }
 
+/*
+ * As zf_loadmem() in gzipfs.c: decompress files smaller than
+ * zip.memory_limit into memory in one go at open time.
+ */
+static int
+bzf_loadmem(struct open_file *f)
+{
+    struct bz_file	*bzf = (struct bz_file *)f->f_fsdata;
+    struct stat		sb;
+    char		*buf, *nbuf;
+    size_t		limit, bufsize, len, resid;
+
+    if (getenv("zip.memory_limit") == NULL)
+	return(0);
+    limit = strtol(getenv("zip.memory_limit"), NULL, 0);
+    if (limit == 0)
+	return(0);
+
+    /* Start with a guess from the compressed size and grow as needed */
+    bufsize = 256 * 1024;
+    if (fstat(bzf->bzf_rawfd, &sb) == 0 && sb.st_size * 4 > bufsize)
+	bufsize = sb.st_size * 4;
+    if (bufsize > limit)
+	bufsize = limit;
+    buf = NULL;
+    len = 0;
+    for (;;) {
+	if ((nbuf = realloc(buf, bufsize)) == NULL)
+	    break;
+	buf = nbuf;
+	if (bzf_read(f, buf + len, bufsize - len, &resid) != 0)
+	    break;
+	len = bufsize - resid;
+	if (bzf->bzf_endseen) {
+	    if (len < bufsize && len > 0 && (nbuf = realloc(buf, len)) != NULL)
+		buf = nbuf;
+	    bzf->bzf_mem = buf;
+	    bzf->bzf_memsize = len;
+	    bzf->bzf_mempos = 0;
+	    /* Give back the decompressor's block buffers and the index */
+	    BZ2_bzDecompressEnd(&bzf->bzf_bzstream);
+	    if (bzf->bzf_index.bi_points != NULL)
+		free(bzf->bzf_index.bi_points);
+	    bzero(&bzf->bzf_index, sizeof(bzf->bzf_index));
+	    return(0);
+	}
+	if (bufsize == limit)
+	    break;
+	bufsize = (bufsize > limit / 2) ? limit : bufsize * 2;
+    }
+
+    /* Too big, or no memory: stream it after all */
+    if (buf != NULL)
+	free(buf);
+    if (bzf_rewind(f, NULL) != 0)
+	return(EIO);
+    return(0);
+}
+
 static int
 bzf_read(struct open_file *f, void *buf, size_t size, size_t *resid)
 {
     struct bz_file	*bzf = (struct bz_file *)f->f_fsdata;
+    size_t		len;
     int			error;
 
+    if (bzf->bzf_mem != NULL) {
+	len = 0;
+	if (bzf->bzf_mempos < bzf->bzf_memsize) {
+	    len = size;
+	    if (bzf->bzf_memsize - bzf->bzf_mempos < len)
+		len = bzf->bzf_memsize - bzf->bzf_mempos;
+	    bcopy(bzf->bzf_mem + bzf->bzf_mempos, buf, len);
+	    bzf->bzf_mempos += len;
+	}
+	if (resid != NULL)
+	    *resid = size - len;
+	return(0);
+    }
+
     bzf->bzf_bzstream.next_out = buf;			/* where and how much */
     bzf->bzf_bzstream.avail_out = size;
 
@@ -242,17 +468,33 @@ bzf_read(struct open_file *f, void *buf, size_t size, size_t *resid)
 	    printf("bzf_read: BZ2_bzDecompress returned %d\n", error);
 	    return(EIO);
 	}
+	bzf_addpoint(bzf);
     }
     if (resid != NULL)
 	*resid = bzf->bzf_bzstream.avail_out;
     return(0);
 }
 
+static off_t
+bzf_tell(struct bz_file *bzf)
+{
+    return(((off_t)bzf->bzf_bzstream.total_out_hi32 << 32) |
+	bzf->bzf_bzstream.total_out_lo32);
+}
+
+/*
+ * Restart decompression at the block described by (bp), or at the
+ * beginning of the file if (bp) is NULL.
+ */
 static int
-bzf_rewind(struct open_file *f)
+bzf_rewind(struct open_file *f, struct bz_point *bp)
 {
     struct bz_file	*bzf = (struct bz_file *)f->f_fsdata;
     struct bz_file	*bzf_tmp;
+    bz_stream		*bzs;
+    DState		*ds;
+    char		hdr[4];
+    off_t		start;
 
     /*
      * Since bzip2 does not have an equivalent inflateReset function a crude
@@ -268,19 +510,57 @@ bzf_rewind(struct open_file *f)
 	return(-1);
     bzero(bzf_tmp, sizeof(struct bz_file));
     bzf_tmp->bzf_rawfd = bzf->bzf_rawfd;
+    bzf_tmp->bzf_index = bzf->bzf_index;
+    bzf_tmp->bzf_discard = bzf->bzf_discard;
+    bzs = &bzf_tmp->bzf_bzstream;
 
     /* Initialise the inflation engine */
-    if (BZ2_bzDecompressInit(&(bzf_tmp->bzf_bzstream), 0, 1) != BZ_OK) {
+    if (BZ2_bzDecompressInit(bzs, 0, 1) != BZ_OK) {
 	free(bzf_tmp);
 	return(-1);
     }
 
-    /* Seek back to the beginning of the file */
-    if (lseek(bzf->bzf_rawfd, 0, SEEK_SET) == -1) {
-	BZ2_bzDecompressEnd(&(bzf_tmp->bzf_bzstream));
+    start = 0;
+    if (bp != NULL) {
+	/*
+	 * Feed the decompressor a stream header so that it expects a
+	 * block next, then hand it the bits of the header's first byte
+	 * that belong to the block and carry on from the byte after.
+	 */
+	hdr[0] = BZ_HDR_B;
+	hdr[1] = BZ_HDR_Z;
+	hdr[2] = BZ_HDR_h;
+	hdr[3] = bzf->bzf_index.bi_level;
+	bzs->next_in = hdr;
+	bzs->avail_in = sizeof(hdr);
+	bzs->avail_out = 0;
+	ds = bzs->state;
+	if (BZ2_bzDecompress(bzs) != BZ_OK || ds->state != BZ_X_BLKHDR_1) {
+	    BZ2_bzDecompressEnd(bzs);
+	    free(bzf_tmp);
+	    return(-1);
+	}
+	start = bp->bp_bit / 8;
+	if (bp->bp_bit % 8) {
+	    ds->bsLive = 8 - bp->bp_bit % 8;
+	    ds->bsBuff = bp->bp_byte & ((1 << ds->bsLive) - 1);
+	    start++;
+	}
+	ds->currBlockNo = bp->bp_block - 1;
+	ds->calculatedCombinedCRC = bp->bp_crc;
+	bzs->total_out_lo32 = bp->bp_out;
+	bzs->total_out_hi32 = bp->bp_out >> 32;
+    }
+
+    /* Seek back to the beginning of the file, or the block */
+    if (lseek(bzf->bzf_rawfd, start, SEEK_SET) == -1) {
+	BZ2_bzDecompressEnd(bzs);
 	free(bzf_tmp);
 	return(-1);
     }
+    bzf_tmp->bzf_rawoffset = start;
+    bzs->next_in = NULL;
+    bzs->avail_in = 0;
 
     /* Free old bz_file data */
     BZ2_bzDecompressEnd(&(bzf->bzf_bzstream));
@@ -292,45 +572,120 @@ bzf_rewind(struct open_file *f)
     return(0);
 }
 
+/*
+ * Restart at (bp) and make sure we got a block header there by
+ * decoding it and checking its CRC.  If not, the index is trimmed so
+ * we don't try that again, and the stream is rewound to the start.
+ */
+static int
+bzf_restore(struct open_file *f, struct bz_point *bp)
+{
+    struct bz_file	*bzf;
+    struct bz_index	*bi;
+    DState		*ds;
+    int			n;
+
+    n = bp - ((struct bz_file *)f->f_fsdata)->bzf_index.bi_points;
+    if (bzf_rewind(f, bp) != 0)
+	return(-1);
+    bzf = (struct bz_file *)f->f_fsdata;
+    ds = bzf->bzf_bzstream.state;
+    bzf->bzf_bzstream.avail_out = 0;
+    /*
+     * Decode up to the block CRC.  A short block may already be fully
+     * decoded and waiting in BZ_X_OUTPUT, which is as far as we can get
+     * without output space.
+     */
+    while (ds->state != BZ_X_OUTPUT && ds->state <= BZ_X_BCRC_4) {
+	if (bzf->bzf_bzstream.avail_in == 0 && bzf_fill(bzf) <= 0)
+	    break;
+	if (BZ2_bzDecompress(&bzf->bzf_bzstream) != BZ_OK)
+	    break;
+    }
+    if ((ds->state == BZ_X_OUTPUT || ds->state > BZ_X_BCRC_4) &&
+	ds->storedBlockCRC == bp->bp_blockcrc)
+	return(0);
+
+    printf("bzf_seek: bad block index entry %d\n", n);
+    bi = &bzf->bzf_index;
+    bi->bi_npoints = n;
+    return(bzf_rewind(f, NULL));
+}
+
 static off_t
 bzf_seek(struct open_file *f, off_t offset, int where)
 {
     struct bz_file	*bzf = (struct bz_file *)f->f_fsdata;
-    off_t		target;
-    char		discard[16];
+    struct bz_index	*bi = &bzf->bzf_index;
+    struct bz_point	*bp;
+    off_t		target, pos;
+    size_t		len;
+    int			i;
 
     switch (where) {
     case SEEK_SET:
 	target = offset;
 	break;
     case SEEK_CUR:
-	target = offset + bzf->bzf_bzstream.total_out_lo32;
+	target = offset + (bzf->bzf_mem != NULL ? bzf->bzf_mempos :
+	    bzf_tell(bzf));
 	break;
     case SEEK_END:
-	target = -1;
+	if (bzf->bzf_mem != NULL) {
+	    target = offset + bzf->bzf_memsize;
+	    break;
+	}
+	/* FALLTHROUGH */
     default:
 	errno = EINVAL;
 	return(-1);
     }
+    if (bzf->bzf_mem != NULL) {
+	if (target < 0) {
+	    errno = EINVAL;
+	    return(-1);
+	}
+	bzf->bzf_mempos = target;
+	return(target);
+    }
 
-    /* Can we get there from here? */
-    if (target < bzf->bzf_bzstream.total_out_lo32 && bzf_rewind(f) != 0) {
-	errno = EOFFSET;
-	return -1;
+    /* Find the last indexed block starting at or before the target */
+    bp = NULL;
+    for (i = bi->bi_npoints - 1; i >= 0; i--) {
+	if (bi->bi_points[i].bp_out <= target) {
+	    bp = &bi->bi_points[i];
+	    break;
+	}
+    }
+
+    /* Can we get there from here, or is a restart closer? */
+    pos = bzf_tell(bzf);
+    if (target < pos || (bp != NULL && bp->bp_out > pos)) {
+	if ((bp != NULL ? bzf_restore(f, bp) : bzf_rewind(f, NULL)) != 0) {
+	    errno = EOFFSET;
+	    return -1;
+	}
     }
 
     /* if bzf_rewind was called then bzf has changed */
     bzf = (struct bz_file *)f->f_fsdata;
 
     /* skip forwards if required */
-    while (target > bzf->bzf_bzstream.total_out_lo32) {
-	errno = bzf_read(f, discard, min(sizeof(discard),
-	    target - bzf->bzf_bzstream.total_out_lo32), NULL);
+    if (target > bzf_tell(bzf) && bzf->bzf_discard == NULL &&
+	(bzf->bzf_discard = malloc(BZ_DISCARDSIZE)) == NULL) {
+	errno = ENOMEM;
+	return(-1);
+    }
+    while (target > bzf_tell(bzf) && bzf->bzf_endseen == 0) {
+	len = BZ_DISCARDSIZE;
+	if (target - bzf_tell(bzf) < len)
+	    len = target - bzf_tell(bzf);
+	errno = bzf_read(f, bzf->bzf_discard, len, NULL);
 	if (errno)
 	    return(-1);
     }
     /* This is where we are (be honest if we overshot) */
-    return(bzf->bzf_bzstream.total_out_lo32);
+    return(bzf_tell(bzf));
 }
 
 static int
@@ -339,9 +694,9 @@ bzf_stat(struct open_file *f, struct stat *sb)
     struct bz_file	*bzf = (struct bz_file *)f->f_fsdata;
     int			result;
 
-    /* stat as normal, but indicate that size is unknown */
+    /* stat as normal, but indicate that size is unknown unless loaded */
     if ((result = fstat(bzf->bzf_rawfd, sb)) == 0)
-	sb->st_size = -1;
+	sb->st_size = bzf->bzf_mem != NULL ? bzf->bzf_memsize : -1;
     return(result);
 }
 
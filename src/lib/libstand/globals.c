@@ -29,4 +29,5 @@ struct	in_addr rootip;			/* root ip address */
 struct	in_addr swapip;			/* swap ip address */
 struct	in_addr gateip;			/* swap ip address */
 n_long	netmask = 0xffffff00;		/* subnet or net mask */
+size_t	udp_maxdata;			/* set by a readudp() with a fixed buffer */
 int	errno;				/* our old friend */
@@ -34,16 +34,50 @@
 
 #define Z_BUFSIZE 2048	/* XXX larger? */
 
+/*
+ * Access points for seeking, as in zlib's examples/zran.c.  While we
+ * inflate we note, every zf_span bytes of output and at a deflate block
+ * boundary, where we are in both streams together with the last 32K of
+ * output.  A seek can then restart inflation from the closest point
+ * before its target instead of from the beginning of the file.  When
+ * the table fills up every other point is dropped and the span doubled,
+ * so any file gets by with at most Z_MAXPOINTS windows.
+ */
+#define Z_WINSIZE	32768
+#define Z_SPAN		(1024 * 1024)
+#define Z_MAXPOINTS	32
+#define Z_DISCARDSIZE	(32 * 1024)
+
+struct z_point
+{
+    off_t		zp_out;		/* uncompressed offset */
+    off_t		zp_in;		/* compressed offset of next byte */
+    int			zp_bits;	/* unused bits of the byte before */
+    uInt		zp_wsize;
+    u_char		*zp_window;	/* preceding output */
+};
+
 struct z_file
 {
     int			zf_rawfd;
     off_t		zf_dataoffset;
+    off_t		zf_rawoffset;	/* where zf_buf's contents end */
+    off_t		zf_size;	/* uncompressed size, -1 if unknown */
     z_stream		zf_zstream;
     char		zf_buf[Z_BUFSIZE];
     int			zf_endseen;
+    int			zf_npoints;
+    off_t		zf_span;
+    struct z_point	zf_points[Z_MAXPOINTS];
+    char		*zf_discard;	/* skip buffer for forward seeks */
+    char		*zf_mem;	/* whole file, see zf_loadmem() */
+    off_t		zf_mempos;
 };
 
 static int	zf_fill(struct z_file *z);
+static void	zf_addpoint(struct z_file *zf);
+static int	zf_loadmem(struct open_file *f);
+static int	zf_rewind(struct open_file *f);
 static int	zf_open(const char *path, struct open_file *f);
 static int	zf_close(struct open_file *f);
 static int	zf_read(struct open_file *f, void *buf, size_t size, size_t *resid);
@@ -79,8 +113,10 @@ zf_fill(struct z_file *zf)
 	/* read to fill buffer and update availibility data */
 	result = read(zf->zf_rawfd, zf->zf_buf + zf->zf_zstream.avail_in, req);
 	zf->zf_zstream.next_in = zf->zf_buf;
-	if (result >= 0)
+	if (result >= 0) {
 	    zf->zf_zstream.avail_in += result;
+	    zf->zf_rawoffset += result;
+	}
     }
     return(result);
 }
@@ -202,6 +238,8 @@ zf_open(const char *fname, struct open_file *f)
         return(ENOMEM);
     bzero(zf, sizeof(struct z_file));
     zf->zf_rawfd = rawfd;
+    zf->zf_size = -1;
+    zf->zf_span = Z_SPAN;
 
     /* Verify that the file is gzipped */
     if (check_header(zf)) {
@@ -220,6 +258,10 @@ zf_open(const char *fname, struct open_file *f)
 
     /* Looks OK, we'll take it */
     f->f_fsdata = zf;
+    if ((error = zf_loadmem(f)) != 0) {
+	zf_close(f);
+	return(error);
+    }
     return(0);
 }
 
@@ -227,22 +269,147 @@ static int
 zf_close(struct open_file *f)
 {
     struct z_file	*zf = (struct z_file *)f->f_fsdata;
+    int			i;
 
     f->f_fsdata = NULL;
     if (zf) {
 	inflateEnd(&(zf->zf_zstream));
 	close(zf->zf_rawfd);
+	for (i = 0; i < zf->zf_npoints; i++)
+	    free(zf->zf_points[i].zp_window);
+	if (zf->zf_discard != NULL)
+	    free(zf->zf_discard);
+	if (zf->zf_mem != NULL)
+	    free(zf->zf_mem);
 	free(zf);
     }
     return(0);
 }
 
+/*
+ * Called at a block boundary: record an access point if we have come
+ * far enough since the last one.
+ */
+static void
+zf_addpoint(struct z_file *zf)
+{
+    struct z_point	*zp;
+    off_t		out, last;
+    int			i;
+
+    out = zf->zf_zstream.total_out;
+    last = zf->zf_npoints ? zf->zf_points[zf->zf_npoints - 1].zp_out : 0;
+    if (out - last < zf->zf_span)
+	return;
+
+    if (zf->zf_npoints == Z_MAXPOINTS) {
+	for (i = 0; i < Z_MAXPOINTS / 2; i++) {
+	    free(zf->zf_points[2 * i].zp_window);
+	    zf->zf_points[i] = zf->zf_points[2 * i + 1];
+	}
+	zf->zf_npoints = Z_MAXPOINTS / 2;
+	zf->zf_span *= 2;
+	if (out - zf->zf_points[zf->zf_npoints - 1].zp_out < zf->zf_span)
+	    return;
+    }
+
+    zp = &zf->zf_points[zf->zf_npoints];
+    if ((zp->zp_window = malloc(Z_WINSIZE)) == NULL)
+	return;
+    zp->zp_wsize = Z_WINSIZE;
+    if (inflateGetDictionary(&zf->zf_zstream, zp->zp_window,
+	&zp->zp_wsize) != Z_OK) {
+	free(zp->zp_window);
+	return;
+    }
+    zp->zp_out = out;
+    zp->zp_in = zf->zf_rawoffset - zf->zf_zstream.avail_in;
+    zp->zp_bits = zf->zf_zstream.data_type & 7;
+    zf->zf_npoints++;
+}
+
+/*
+ * If the zip.memory_limit loader variable is set, inflate the whole file
+ * into memory at open time provided it comes to less than that many
+ * bytes, so that reads and seeks are just copies from then on.  Larger
+ * files are left to be read as a stream.
+ */
+static int
+zf_loadmem(struct open_file *f)
+{
+    struct z_file	*zf = (struct z_file *)f->f_fsdata;
+    struct stat		sb;
+    char		*buf, *nbuf;
+    size_t		limit, bufsize, len, resid;
+    int			i;
+
+    if (getenv("zip.memory_limit") == NULL)
+	return(0);
+    limit = strtol(getenv("zip.memory_limit"), NULL, 0);
+    if (limit == 0)
+	return(0);
+
+    /* Start with a guess from the compressed size and grow as needed */
+    bufsize = 256 * 1024;
+    if (fstat(zf->zf_rawfd, &sb) == 0 && sb.st_size * 4 > bufsize)
+	bufsize = sb.st_size * 4;
+    if (bufsize > limit)
+	bufsize = limit;
+    buf = NULL;
+    len = 0;
+    for (;;) {
+	if ((nbuf = realloc(buf, bufsize)) == NULL)
+	    break;
+	buf = nbuf;
+	if (zf_read(f, buf + len, bufsize - len, &resid) != 0)
+	    break;
+	len = bufsize - resid;
+	if (zf->zf_endseen) {
+	    if (len < bufsize && len > 0 && (nbuf = realloc(buf, len)) != NULL)
+		buf = nbuf;
+	    zf->zf_mem = buf;
+	    zf->zf_mempos = 0;
+	    /* Nothing left to inflate */
+	    inflateEnd(&zf->zf_zstream);
+	    for (i = 0; i < zf->zf_npoints; i++)
+		free(zf->zf_points[i].zp_window);
+	    zf->zf_npoints = 0;
+	    return(0);
+	}
+	if (bufsize == limit)
+	    break;
+	bufsize = (bufsize > limit / 2) ? limit : bufsize * 2;
+    }
+
+    /* Too big, or no memory: stream it after all */
+    if (buf != NULL)
+	free(buf);
+    if (zf_rewind(f) != 0)
+	return(EIO);
+    return(0);
+}
+
 static int
 zf_read(struct open_file *f, void *buf, size_t size, size_t *resid)
 {
     struct z_file	*zf = (struct z_file *)f->f_fsdata;
+    size_t		len;
     int			error;
 
+    if (zf->zf_mem != NULL) {
+	len = 0;
+	if (zf->zf_mempos < zf->zf_size) {
+	    len = size;
+	    if (zf->zf_size - zf->zf_mempos < len)
+		len = zf->zf_size - zf->zf_mempos;
+	    bcopy(zf->zf_mem + zf->zf_mempos, buf, len);
+	    zf->zf_mempos += len;
+	}
+	if (resid != NULL)
+	    *resid = size - len;
+	return(0);
+    }
+
     zf->zf_zstream.next_out = buf;			/* where and how much */
     zf->zf_zstream.avail_out = size;
 
@@ -258,15 +425,19 @@ zf_read(struct open_file *f, void *buf, size_t size, size_t *resid)
 	    break;
 	}
 
-	error = inflate(&zf->zf_zstream, Z_SYNC_FLUSH);	/* decompression pass */
+	error = inflate(&zf->zf_zstream, Z_BLOCK);	/* decompression pass */
 	if (error == Z_STREAM_END) {			/* EOF, all done */
 	    zf->zf_endseen = 1;
+	    zf->zf_size = zf->zf_zstream.total_out;
 	    break;
 	}
 	if (error != Z_OK) {				/* argh, decompression error */
 	    printf("inflate: %s\n", zf->zf_zstream.msg);
 	    return(EIO);
 	}
+	/* Between two blocks, and not past the last one? */
+	if ((zf->zf_zstream.data_type & (128 | 64)) == 128)
+	    zf_addpoint(zf);
     }
     if (resid != NULL)
 	*resid = zf->zf_zstream.avail_out;
@@ -280,6 +451,7 @@ zf_rewind(struct open_file *f)
 
     if (lseek(zf->zf_rawfd, zf->zf_dataoffset, SEEK_SET) == -1)
 	return(-1);
+    zf->zf_rawoffset = zf->zf_dataoffset;
     zf->zf_zstream.avail_in = 0;
     zf->zf_zstream.next_in = NULL;
     zf->zf_endseen = 0;
@@ -288,38 +460,121 @@ zf_rewind(struct open_file *f)
     return(0);
 }
 
+/*
+ * Restart inflation at access point (zp).
+ */
+static int
+zf_restore(struct open_file *f, struct z_point *zp)
+{
+    struct z_file	*zf = (struct z_file *)f->f_fsdata;
+    off_t		in;
+    int			c;
+
+    in = zp->zp_in - (zp->zp_bits ? 1 : 0);
+    if (lseek(zf->zf_rawfd, in, SEEK_SET) == -1)
+	return(-1);
+    zf->zf_rawoffset = in;
+    zf->zf_zstream.avail_in = 0;
+    zf->zf_zstream.next_in = NULL;
+    zf->zf_endseen = 0;
+    (void)inflateReset(&zf->zf_zstream);
+    if (zp->zp_bits) {
+	if ((c = get_byte(zf, &in)) == -1)
+	    return(-1);
+	(void)inflatePrime(&zf->zf_zstream, zp->zp_bits,
+	    c >> (8 - zp->zp_bits));
+    }
+    if (inflateSetDictionary(&zf->zf_zstream, zp->zp_window,
+	zp->zp_wsize) != Z_OK)
+	return(-1);
+    /* inflateReset() cleared this; it is our file position */
+    zf->zf_zstream.total_out = zp->zp_out;
+
+    return(0);
+}
+
+/*
+ * Position the stream at (target), or at the end if (target) is -1,
+ * starting from the closest access point before it unless carrying on
+ * from where we are is nearer.
+ */
+static int
+zf_skip(struct open_file *f, off_t target)
+{
+    struct z_file	*zf = (struct z_file *)f->f_fsdata;
+    struct z_point	*zp;
+    off_t		pos;
+    size_t		len;
+    int			i;
+
+    zp = NULL;
+    for (i = zf->zf_npoints - 1; i >= 0; i--) {
+	if (target == -1 || zf->zf_points[i].zp_out <= target) {
+	    zp = &zf->zf_points[i];
+	    break;
+	}
+    }
+
+    pos = zf->zf_zstream.total_out;
+    if ((target != -1 && target < pos) || (zp != NULL && zp->zp_out > pos)) {
+	if (zp != NULL) {
+	    if (zf_restore(f, zp) != 0)
+		return(EIO);
+	} else if (zf_rewind(f) != 0) {
+	    return(EIO);
+	}
+    }
+
+    if (zf->zf_discard == NULL &&
+	(zf->zf_discard = malloc(Z_DISCARDSIZE)) == NULL)
+	return(ENOMEM);
+    while (zf->zf_endseen == 0 &&
+	(target == -1 || target > zf->zf_zstream.total_out)) {
+	len = Z_DISCARDSIZE;
+	if (target != -1 && target - zf->zf_zstream.total_out < len)
+	    len = target - zf->zf_zstream.total_out;
+	if ((i = zf_read(f, zf->zf_discard, len, NULL)) != 0)
+	    return(i);
+    }
+    return(0);
+}
+
 static off_t
 zf_seek(struct open_file *f, off_t offset, int where)
 {
     struct z_file	*zf = (struct z_file *)f->f_fsdata;
     off_t		target;
-    char		discard[16];
 
     switch (where) {
     case SEEK_SET:
 	target = offset;
 	break;
     case SEEK_CUR:
-	target = offset + zf->zf_zstream.total_out;
+	target = offset + (zf->zf_mem != NULL ? zf->zf_mempos :
+	    (off_t)zf->zf_zstream.total_out);
 	break;
     case SEEK_END:
-	target = -1;
+	/* Have to inflate everything once to learn the size */
+	if (zf->zf_size == -1 && (errno = zf_skip(f, -1)) != 0)
+	    return(-1);
+	target = offset + zf->zf_size;
+	break;
     default:
 	errno = EINVAL;
 	return(-1);
     }
-
-    /* rewind if required */
-    if (target < zf->zf_zstream.total_out && zf_rewind(f) != 0)
+    if (target < 0) {
+	errno = EINVAL;
 	return(-1);
-
-    /* skip forwards if required */
-    while (target > zf->zf_zstream.total_out) {
-	errno = zf_read(f, discard, min(sizeof(discard),
-	    target - zf->zf_zstream.total_out), NULL);
-	if (errno)
-	    return(-1);
     }
+    if (zf->zf_mem != NULL) {
+	zf->zf_mempos = target;
+	return(target);
+    }
+
+    if (target != zf->zf_zstream.total_out &&
+	(errno = zf_skip(f, target)) != 0)
+	return(-1);
     /* This is where we are (be honest if we overshot) */
     return(zf->zf_zstream.total_out);
 }
@@ -331,8 +586,8 @@ zf_stat(struct open_file *f, struct stat *sb)
     struct z_file	*zf = (struct z_file *)f->f_fsdata;
     int			result;
 
-    /* stat as normal, but indicate that size is unknown */
+    /* stat as normal, but indicate that size is unknown unless seen */
     if ((result = fstat(zf->zf_rawfd, sb)) == 0)
-	sb->st_size = -1;
+	sb->st_size = zf->zf_size;
     return(result);
 }
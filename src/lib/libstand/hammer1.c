@@ -47,6 +47,7 @@
 #include "boot2.h"
 #else
 #include <sys/param.h>
+#include <sys/queue.h>
 #include <stddef.h>
 #include <stdint.h>
 #endif
@@ -69,18 +70,35 @@
 
 #include <vfs/hammer/hammer_disk.h>
 
+/*
+ * Position of the last leaf element returned by hfind(), so that
+ * sequential file reads can step to the next element instead of
+ * descending from the root again.
+ */
+struct hcursor {
+	hammer_off_t	node;		/* leaf node, 0 if invalid */
+	int		index;
+};
+
 #ifndef BOOT2
+/*
+ * Buffer cache of HAMMER_BUFSIZE blocks, shared by all files open on a
+ * volume.  The number of buffers can be set in bytes with the
+ * hammer.cache_size loader variable, up to an eighth of the heap.
+ */
 struct blockentry {
-	hammer_off_t	off;
-	int		use;
+	hammer_off_t	off;		/* -1 if invalid */
+	LIST_ENTRY(blockentry) hash;
+	TAILQ_ENTRY(blockentry) lru;
 	char		*data;
 };
 
 #ifdef TESTING
-#define NUMCACHE	16
+#define HAMMER_NUMCACHE	16
 #else
-#define	NUMCACHE	6
+#define	HAMMER_NUMCACHE	8
 #endif
+#define HAMMER_MINCACHE	4
 
 struct hfs {
 #ifdef TESTING
@@ -92,10 +110,16 @@ struct hfs {
 	int64_t		buf_beg;
 	int64_t		last_dir_ino;
 	u_int8_t	last_dir_cap_flags;
-	int		lru;
-	struct blockentry cache[NUMCACHE];
+	int		ncache;
+	u_int		hashmask;
+	LIST_HEAD(, blockentry) *hash;
+	TAILQ_HEAD(hammer_lru, blockentry) lru;	/* MRU first */
+	struct blockentry *cache;
 };
 
+static u_int	hammer_hits, hammer_misses, hammer_nbufs;
+static u_int64_t hammer_bytes;
+
 static void *
 hread(struct hfs *hfs, hammer_off_t off)
 {
@@ -106,37 +130,57 @@ hread(struct hfs *hfs, hammer_off_t off)
 	if (HAMMER_ZONE_DECODE(off) != HAMMER_ZONE_RAW_VOLUME_INDEX)
 		boff += hfs->buf_beg;
 
-	struct blockentry *be = NULL;
-	for (int i = 0; i < NUMCACHE; i++) {
-		if (be == NULL || be->use > hfs->cache[i].use)
-			be = &hfs->cache[i];
-		if (hfs->cache[i].off == boff) {
-			be = &hfs->cache[i];
-			break;
+	u_int h = (u_int)(boff >> HAMMER_BUFSHIFT) & hfs->hashmask;
+	struct blockentry *be;
+
+	LIST_FOREACH(be, &hfs->hash[h], hash) {
+		if (be->off == boff) {
+			hammer_hits++;
+			goto found;
 		}
 	}
-	if (be->off != boff) {
-		// Didn't find any match
-		be->off = boff;
+
+	// Didn't find any match, recycle the least recently used buffer
+	hammer_misses++;
+	be = TAILQ_LAST(&hfs->lru, hammer_lru);
+	if (be->off != -1) {
+		LIST_REMOVE(be, hash);
+		be->off = -1;
+	}
 #ifdef TESTING
-		ssize_t res = pread(hfs->fd, be->data, HAMMER_BUFSIZE,
-				    boff & HAMMER_OFF_SHORT_MASK);
-		if (res != HAMMER_BUFSIZE)
-			err(1, "short read on off %llx", boff);
+	ssize_t res = pread(hfs->fd, be->data, HAMMER_BUFSIZE,
+			    boff & HAMMER_OFF_SHORT_MASK);
+	if (res != HAMMER_BUFSIZE)
+		err(1, "short read on off %llx", boff);
 #else	// libstand
-		size_t rlen;
-		int rv = hfs->f->f_dev->dv_strategy(hfs->f->f_devdata, F_READ,
-			boff >> DEV_BSHIFT, HAMMER_BUFSIZE,
-			be->data, &rlen);
-		if (rv || rlen != HAMMER_BUFSIZE)
-			return (NULL);
+	size_t rlen;
+	int rv = hfs->f->f_dev->dv_strategy(hfs->f->f_devdata, F_READ,
+		boff >> DEV_BSHIFT, HAMMER_BUFSIZE,
+		be->data, &rlen);
+	if (rv || rlen != HAMMER_BUFSIZE)
+		return (NULL);
 #endif
-	}
+	hammer_bytes += HAMMER_BUFSIZE;
+	be->off = boff;
+	LIST_INSERT_HEAD(&hfs->hash[h], be, hash);
 
-	be->use = ++hfs->lru;
+found:
+	TAILQ_REMOVE(&hfs->lru, be, lru);
+	TAILQ_INSERT_HEAD(&hfs->lru, be, lru);
 	return &be->data[off & HAMMER_BUFMASK];
 }
 
+#ifdef LIBSTAND
+void
+hammerstats(void)
+{
+	printf("hammer cache: %u buffers of %d bytes\n",
+	       hammer_nbufs, HAMMER_BUFSIZE);
+	printf("%u hits, %u misses, %llu bytes read\n",
+	       hammer_hits, hammer_misses, (unsigned long long)hammer_bytes);
+}
+#endif
+
 #else	/* BOOT2 */
 
 struct hammer_dmadat {
@@ -409,7 +453,8 @@ hprintb(hammer_base_elm_t e)
 #endif /* !BOOT2 */
 
 static hammer_btree_leaf_elm_t
-hfind(struct hfs *hfs, hammer_base_elm_t key, hammer_base_elm_t end)
+hfind(struct hfs *hfs, hammer_base_elm_t key, hammer_base_elm_t end,
+      struct hcursor *cur)
 {
 #if DEBUG > 1
 	printf("searching for ");
@@ -519,6 +564,10 @@ backtrack:
 		if (hammer_btree_cmp(end, &e->base) < -1)
 			goto fail;
 
+	if (cur != NULL) {
+		cur->node = nodeoff;
+		cur->index = n;
+	}
 	return (&e->leaf);
 
 fail:
@@ -528,6 +577,54 @@ fail:
 	return (NULL);
 }
 
+#ifndef BOOT2
+/*
+ * Like hfind(), but start from the element (cur) points to when the key
+ * lies past it in the same leaf, as it does for sequential reads.
+ */
+static hammer_btree_leaf_elm_t
+hfind_next(struct hfs *hfs, hammer_base_elm_t key, hammer_base_elm_t end,
+	   struct hcursor *cur)
+{
+	hammer_node_ondisk_t node;
+	hammer_btree_elm_t e;
+	int n;
+
+	if (cur->node == 0)
+		goto search;
+	node = hread(hfs, cur->node);
+	if (node == NULL || node->type != HAMMER_BTREE_TYPE_LEAF ||
+	    cur->index >= node->count)
+		goto search;
+
+	// Start from an element known to be below the key, after a
+	// backward seek there is none.
+	n = cur->index;
+	if (hammer_btree_cmp(key, &node->elms[n].base) <= 1) {
+		if (n == 0 ||
+		    hammer_btree_cmp(key, &node->elms[n - 1].base) <= 1)
+			goto search;
+		n--;
+	}
+
+	for (n++; n < node->count; n++) {
+		e = &node->elms[n];
+		if (hammer_btree_cmp(key, &e->base) > 1)
+			continue;
+		if (e->base.delete_tid != 0)
+			continue;
+		if (end != NULL && hammer_btree_cmp(end, &e->base) < -1)
+			return (NULL);
+		cur->index = n;
+		return (&e->leaf);
+	}
+
+	// Ran off the leaf, the next element is elsewhere in the tree
+search:
+	return (hfind(hfs, key, end, cur));
+}
+#endif
+
 /*
  * Returns the directory entry localization field based on the directory
  * inode's capabilities.
@@ -545,7 +642,7 @@ hdirlocalization(struct hfs *hfs, ino_t ino)
 		hammer_btree_leaf_elm_t e;
 		hammer_data_ondisk_t ed;
 
-		e = hfind(hfs, &key, &key);
+		e = hfind(hfs, &key, &key, NULL);
 		if (e) {
 			ed = hread(hfs, e->data_offset);
 			if (ed) {
@@ -587,7 +684,7 @@ hreaddir(struct hfs *hfs, ino_t ino, int64_t *off, struct dirent *de)
 
 	hammer_btree_leaf_elm_t e;
 
-	e = hfind(hfs, &key, &end);
+	e = hfind(hfs, &key, &end, NULL);
 	if (e == NULL) {
 		errno = ENOENT;
 		return (-1);
@@ -627,7 +724,7 @@ hresolve(struct hfs *hfs, ino_t dirino, const char *name)
 	end.key = HAMMER_MAX_KEY;
 
 	hammer_btree_leaf_elm_t e;
-	while ((e = hfind(hfs, &key, &end)) != NULL) {
+	while ((e = hfind(hfs, &key, &end, NULL)) != NULL) {
 		key.key = e->base.key + 1;
 
 		size_t elen = e->data_len - HAMMER_ENTRY_NAME_OFF;
@@ -705,7 +802,7 @@ hstat(struct hfs *hfs, ino_t ino, struct stat* st)
 	key.localization = HAMMER_LOCALIZE_INODE;
 	key.rec_type = HAMMER_RECTYPE_INODE;
 
-	hammer_btree_leaf_elm_t e = hfind(hfs, &key, &key);
+	hammer_btree_leaf_elm_t e = hfind(hfs, &key, &key, NULL);
 	if (e == NULL) {
 #ifndef BOOT2
 		errno = ENOENT;
@@ -726,8 +823,13 @@ hstat(struct hfs *hfs, ino_t ino, struct stat* st)
 }
 #endif
 
+/*
+ * Read file data.  (cur) may carry the B-Tree position from one call to
+ * the next, it is ignored in BOOT2.
+ */
 static ssize_t
-hreadf(struct hfs *hfs, ino_t ino, int64_t off, int64_t len, char *buf)
+hreadf(struct hfs *hfs, ino_t ino, int64_t off, int64_t len, char *buf,
+       struct hcursor *cur)
 {
 	int64_t startoff = off;
 	struct hammer_base_elm key, end;
@@ -741,7 +843,11 @@ hreadf(struct hfs *hfs, ino_t ino, int64_t off, int64_t len, char *buf)
 
 	while (len > 0) {
 		key.key = off + 1;
-		hammer_btree_leaf_elm_t e = hfind(hfs, &key, &end);
+#ifdef BOOT2
+		hammer_btree_leaf_elm_t e = hfind(hfs, &key, &end, NULL);
+#else
+		hammer_btree_leaf_elm_t e = hfind_next(hfs, &key, &end, cur);
+#endif
 		int64_t dlen;
 
 		if (e == NULL || off > e->base.key) {
@@ -828,7 +934,7 @@ boot2_hammer_lookup(const char *path)
 static ssize_t
 boot2_hammer_read(boot2_ino_t ino, void *buf, size_t len)
 {
-	ssize_t rlen = hreadf(&hfs, ino, fs_off, len, buf);
+	ssize_t rlen = hreadf(&hfs, ino, fs_off, len, buf, NULL);
 	if (rlen != -1)
 		fs_off += rlen;
 	return (rlen);
@@ -843,23 +949,91 @@ const struct boot2_fsapi boot2_hammer_api = {
 #endif
 
 #ifndef BOOT2
+static void
+hclose(struct hfs *hfs)
+{
+#if DEBUG
+	printf("hclose\n");
+#endif
+	if (hfs->cache != NULL) {
+		for (int i = 0; i < hfs->ncache; i++) {
+			if (hfs->cache[i].data)
+				free(hfs->cache[i].data);
+		}
+		hammer_nbufs -= hfs->ncache;
+		free(hfs->cache);
+		hfs->cache = NULL;
+	}
+	if (hfs->hash != NULL) {
+		free(hfs->hash);
+		hfs->hash = NULL;
+	}
+}
+
 static int
 hinit(struct hfs *hfs)
 {
+	int ncache = HAMMER_NUMCACHE;
+	u_int nhash;
+#ifdef LIBSTAND
+	size_t heapsize;
+	long n;
+#endif
+
 #if DEBUG
 	printf("hinit\n");
 #endif
-	for (int i = 0; i < NUMCACHE; i++) {
-		hfs->cache[i].data = malloc(HAMMER_BUFSIZE);
-		hfs->cache[i].off = -1;	// invalid
-		hfs->cache[i].use = 0;
+#ifdef LIBSTAND
+	if (getenv("hammer.cache_size") != NULL) {
+		n = strtol(getenv("hammer.cache_size"), NULL, 0) /
+		    HAMMER_BUFSIZE;
+		// The mount cache keeps the buffers, leave the heap the rest
+		(void)getheap(&heapsize);
+		if (n > (long)(heapsize / 8 / HAMMER_BUFSIZE))
+			n = heapsize / 8 / HAMMER_BUFSIZE;
+		ncache = n;
+	}
+#endif
+	if (ncache < HAMMER_MINCACHE)
+		ncache = HAMMER_MINCACHE;
+
+	hfs->ncache = 0;
+	for (;;) {
+		for (nhash = 1; nhash < (u_int)ncache / 2; nhash <<= 1)
+			;
+		hfs->cache = malloc(ncache * sizeof(*hfs->cache));
+		hfs->hash = malloc(nhash * sizeof(*hfs->hash));
+		if (hfs->cache != NULL && hfs->hash != NULL)
+			break;
+		if (hfs->cache != NULL)
+			free(hfs->cache);
+		if (hfs->hash != NULL)
+			free(hfs->hash);
+		hfs->cache = NULL;
+		hfs->hash = NULL;
+		if (ncache == HAMMER_MINCACHE)
+			goto nomem;
+		ncache /= 2;
+		if (ncache < HAMMER_MINCACHE)
+			ncache = HAMMER_MINCACHE;
+	}
+	hfs->hashmask = nhash - 1;
+	for (u_int i = 0; i < nhash; i++)
+		LIST_INIT(&hfs->hash[i]);
+	TAILQ_INIT(&hfs->lru);
 
-#if DEBUG
+	// Take what we can get if the heap is short
+	for (int i = 0; i < ncache; i++) {
+		hfs->cache[i].data = malloc(HAMMER_BUFSIZE);
 		if (hfs->cache[i].data == NULL)
-			printf("malloc failed\n");
-#endif
+			break;
+		hfs->cache[i].off = -1;	// invalid
+		TAILQ_INSERT_TAIL(&hfs->lru, &hfs->cache[i], lru);
+		hfs->ncache++;
 	}
-	hfs->lru = 0;
+	hammer_nbufs += hfs->ncache;
+	if (hfs->ncache < HAMMER_MINCACHE)
+		goto nomem;
 	hfs->last_dir_ino = -1;
 
 	hammer_volume_ondisk_t volhead = hread(hfs, HAMMER_ZONE_ENCODE(1, 0));
@@ -875,10 +1049,7 @@ hinit(struct hfs *hfs)
 #endif
 
 	if (volhead == NULL || volhead->vol_signature != HAMMER_FSBUF_VOLUME) {
-		for (int i = 0; i < NUMCACHE; i++) {
-			free(hfs->cache[i].data);
-			hfs->cache[i].data = NULL;
-		}
+		hclose(hfs);
 		errno = ENODEV;
 		return (-1);
 	}
@@ -887,59 +1058,82 @@ hinit(struct hfs *hfs)
 	hfs->buf_beg = volhead->vol_buf_beg;
 
 	return (0);
-}
 
-static void
-hclose(struct hfs *hfs)
-{
+nomem:
 #if DEBUG
-	printf("hclose\n");
+	printf("malloc failed\n");
 #endif
-	for (int i = 0; i < NUMCACHE; i++) {
-		if (hfs->cache[i].data) {
-			free(hfs->cache[i].data);
-			hfs->cache[i].data = NULL;
-		}
-	}
+	hclose(hfs);
+	errno = ENOMEM;
+	return (-1);
 }
 #endif
 
 #ifdef LIBSTAND
 struct hfile {
-	struct hfs	hfs;
+	struct hfs	*hfs;
 	ino_t		ino;
 	int64_t		fsize;
+	struct hcursor	cur;		/* B-Tree position for hreadf */
 };
 
+/*
+ * The hfs is shared by every file open on the volume, point its I/O
+ * at the file we are working for.
+ */
+static struct hfs *
+hfile_hfs(struct open_file *f)
+{
+	struct hfile *hf = f->f_fsdata;
+
+	hf->hfs->f = f;
+	return (hf->hfs);
+}
+
 static int
 hammer_open(const char *path, struct open_file *f)
 {
 	struct hfile *hf = malloc(sizeof(*hf));
+	struct hfs *hfs;
 
 	bzero(hf, sizeof(*hf));
 	f->f_fsdata = hf;
-	hf->hfs.f = f;
 	f->f_offset = 0;
 
-	int rv = hinit(&hf->hfs);
-	if (rv) {
-		f->f_fsdata = NULL;
-		free(hf);
-		return (rv);
+	/*
+	 * The volume root and buffer cache live in the mount cache,
+	 * only set them up the first time we see the volume.
+	 */
+	if ((hfs = f->f_mntdata) == NULL) {
+		hfs = malloc(sizeof(*hfs));
+		bzero(hfs, sizeof(*hfs));
+		hfs->f = f;
+
+		int rv = hinit(hfs);
+		if (rv) {
+			f->f_fsdata = NULL;
+			free(hfs);
+			free(hf);
+			return (rv);
+		}
+		f->f_mntdata = hfs;
 	}
+	hf->hfs = hfs;
+	hfs->f = f;
 
 #if DEBUG
 	printf("hammer_open %s %p %ld\n", path, f);
 #endif
 
-	hf->ino = hlookup(&hf->hfs, path);
+	hf->ino = hlookup(hfs, path);
 	if (hf->ino == -1)
 		goto fail;
 
 	struct stat st;
-	if (hstat(&hf->hfs, hf->ino, &st) == -1)
+	if (hstat(hfs, hf->ino, &st) == -1)
 		goto fail;
 	hf->fsize = st.st_size;
+	f->f_rasize = HAMMER_BUFSIZE;
 
 #if DEBUG
 	printf("	%ld\n", (long)hf->fsize);
@@ -952,7 +1146,6 @@ fail:
 	printf("hammer_open fail\n");
 #endif
 	f->f_fsdata = NULL;
-	hclose(&hf->hfs);
 	free(hf);
 	return (ENOENT);
 }
@@ -963,13 +1156,20 @@ hammer_close(struct open_file *f)
 	struct hfile *hf = f->f_fsdata;
 
 	f->f_fsdata = NULL;
-	if (hf) {
-	    hclose(&hf->hfs);
+	if (hf)
 	    free(hf);
-	}
 	return (0);
 }
 
+static void
+hammer_unmount(void *data)
+{
+	struct hfs *hfs = data;
+
+	hclose(hfs);
+	free(hfs);
+}
+
 static int
 hammer_read(struct open_file *f, void *buf, size_t len, size_t *resid)
 {
@@ -986,7 +1186,8 @@ hammer_read(struct open_file *f, void *buf, size_t len, size_t *resid)
 	if (f->f_offset + len > hf->fsize)
 		maxlen = hf->fsize - f->f_offset;
 
-	ssize_t rlen = hreadf(&hf->hfs, hf->ino, f->f_offset, maxlen, buf);
+	ssize_t rlen = hreadf(hfile_hfs(f), hf->ino, f->f_offset, maxlen, buf,
+			      &hf->cur);
 	if (rlen == -1)
 		return (EINVAL);
 
@@ -1022,7 +1223,7 @@ hammer_stat(struct open_file *f, struct stat *st)
 {
 	struct hfile *hf = f->f_fsdata;
 
-	return (hstat(&hf->hfs, hf->ino, st));
+	return (hstat(hfile_hfs(f), hf->ino, st));
 }
 
 static int
@@ -1031,7 +1232,7 @@ hammer_readdir(struct open_file *f, struct dirent *d)
 	struct hfile *hf = f->f_fsdata;
 
 	int64_t off = f->f_offset;
-	int rv = hreaddir(&hf->hfs, hf->ino, &off, d);
+	int rv = hreaddir(hfile_hfs(f), hf->ino, &off, d);
 	f->f_offset = off;
 	return (rv);
 }
@@ -1045,7 +1246,8 @@ struct fs_ops hammer_fsops = {
 	null_write,
 	hammer_seek,
 	hammer_stat,
-	hammer_readdir
+	hammer_readdir,
+	hammer_unmount
 };
 #endif	// LIBSTAND
 
@@ -1093,10 +1295,11 @@ main(int argc, char **argv)
 			}
 		} else if (S_ISREG(st.st_mode)) {
 			char *buf = malloc(100000);
+			struct hcursor cur = { 0, 0 };
 			int64_t off = 0;
 			while (off < st.st_size) {
 				int64_t len = MIN(100000, st.st_size - off);
-				int64_t rl = hreadf(&hfs, ino, off, len, buf);
+				int64_t rl = hreadf(&hfs, ino, off, len, buf, &cur);
 				fwrite(buf, rl, 1, stdout);
 				off += rl;
 			}
@@ -65,6 +65,12 @@
 
 #include <vfs/hammer2/hammer2_disk.h>
 
+#if defined(LIBSTAND) || defined(TESTING)
+#include <zlib.h>
+#define H2_COMPRESSION	1
+#define H2_MCACHE	1
+#endif
+
 uint32_t iscsi_crc32(const void *buf, size_t size);
 uint32_t iscsi_crc32_ext(const void *buf, size_t size, uint32_t ocrc);
 
@@ -73,9 +79,56 @@ static hammer2_blockref_t saved_base;
 
 #define hammer2_icrc32(buf, size)	iscsi_crc32(buf, size)
 
+#ifdef H2_COMPRESSION
+/*
+ * Decompressed data blocks, so that a file read in small pieces doesn't
+ * decompress the same block over and over.
+ */
+#define H2_NUMDCACHE	2
+
+struct hammer2_dblock {
+	hammer2_off_t			data_off;	/* 0 if invalid */
+	int				use;
+	char				*data;		/* HAMMER2_PBUFSIZE */
+};
+#endif
+
+#ifdef H2_MCACHE
+/*
+ * Metadata block cache (inodes and indirect blocks), keyed by data_off.
+ * Its size in bytes can be set with the hammer2.cache_size variable,
+ * each block takes one entry whatever its size.
+ */
+#ifdef TESTING
+#define H2_MCACHE_SIZE	(4 * 1024 * 1024)
+#else
+#define H2_MCACHE_SIZE	(256 * 1024)
+#endif
+#define H2_MCACHE_AVG	4096		/* entries = size / H2_MCACHE_AVG */
+#define H2_NUMMCACHE_MIN	8
+
+struct hammer2_mblock {
+	hammer2_off_t			data_off;	/* 0 if invalid */
+	int				use;
+	size_t				bytes;
+	hammer2_media_data_t		*data;
+};
+#endif
+
 struct hammer2_fs {
 	hammer2_blockref_t		sroot;
 	hammer2_blockset_t		sroot_blockset;
+#ifdef H2_COMPRESSION
+	struct hammer2_dblock		dcache[H2_NUMDCACHE];
+	int				dcache_lru;
+#endif
+#ifdef H2_MCACHE
+	struct hammer2_mblock		*mcache;
+	int				nmcache;
+	int				mcache_lru;
+	size_t				mcache_bytes;	/* allocated */
+	size_t				mcache_size;	/* limit */
+#endif
 #if defined(TESTING)
 	int				fd;
 #elif defined(LIBSTAND)
@@ -215,7 +268,7 @@ h2read(struct hammer2_fs *hfs, void *buf, size_t nbytes, off_t off)
 	int rc;
 
 #if defined(TESTING)
-	rc = pread(hfs->fd, &media, nbytes, off);
+	rc = pread(hfs->fd, buf, nbytes, off);
 	if (rc == (int)nbytes)
 		rc = 0;
 	else
@@ -252,6 +305,267 @@ h2read(struct hammer2_fs *hfs, void *buf, size_t nbytes, off_t off)
  * its device file descriptor initialized.
  */
 
+#ifdef H2_COMPRESSION
+
+/*
+ * Decompress an LZ4 block.  Returns the decompressed size or -1 if the
+ * input is corrupt or would overflow (dst).
+ */
+static
+int
+h2lz4_decompress(const char *src, char *dst, int srclen, int dstlen)
+{
+	const uint8_t *ip = (const uint8_t *)src;
+	const uint8_t *iend = ip + srclen;
+	uint8_t *op = (uint8_t *)dst;
+	uint8_t *oend = op + dstlen;
+	const uint8_t *match;
+	size_t lit;
+	size_t mlen;
+	size_t moff;
+	uint8_t token;
+	uint8_t c;
+
+	for (;;) {
+		if (ip >= iend)
+			return(-1);
+		token = *ip++;
+
+		/*
+		 * Literal run, the last sequence ends the block after it.
+		 */
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip >= iend)
+					return(-1);
+				c = *ip++;
+				lit += c;
+			} while (c == 255);
+		}
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return(-1);
+		bcopy(ip, op, lit);
+		ip += lit;
+		op += lit;
+		if (ip == iend)
+			break;
+
+		/*
+		 * Match copy, may overlap its own output.
+		 */
+		if (iend - ip < 2)
+			return(-1);
+		moff = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (moff == 0 || moff > (size_t)(op - (uint8_t *)dst))
+			return(-1);
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= iend)
+					return(-1);
+				c = *ip++;
+				mlen += c;
+			} while (c == 255);
+		}
+		mlen += 4;
+		if (mlen > (size_t)(oend - op))
+			return(-1);
+		match = op - moff;
+		while (mlen--)
+			*op++ = *match++;
+	}
+	return((int)(op - (uint8_t *)dst));
+}
+
+/*
+ * Decompress a zlib block.  Returns the decompressed size or -1.
+ */
+static
+int
+h2zlib_decompress(const char *src, char *dst, int srclen, int dstlen)
+{
+	z_stream strm;
+	int rc;
+
+	bzero(&strm, sizeof(strm));
+	if (inflateInit(&strm) != Z_OK)
+		return(-1);
+	strm.next_in = (void *)(uintptr_t)src;
+	strm.avail_in = srclen;
+	strm.next_out = (void *)dst;
+	strm.avail_out = dstlen;
+	rc = inflate(&strm, Z_FINISH);
+	inflateEnd(&strm);
+	if (rc != Z_STREAM_END)
+		return(-1);
+	return(dstlen - (int)strm.avail_out);
+}
+
+#endif
+
+/*
+ * Load a compressed data block and return its decompressed contents in
+ * (*pptr).  Returns the logical size of the block or -1 on error.
+ * Clobbers media.
+ */
+static
+int
+h2decompress(struct hammer2_fs *hfs, hammer2_blockref_t *bref, void **pptr)
+{
+#ifdef H2_COMPRESSION
+	struct hammer2_dblock *db;
+	char *src;
+	int dev_boff;
+	int dev_bsize;
+	int lsize;
+	int psize;
+	int clen;
+	int n;
+	int i;
+
+	lsize = 1 << bref->keybits;
+	if (lsize > HAMMER2_PBUFSIZE)
+		lsize = HAMMER2_PBUFSIZE;
+
+	db = NULL;
+	for (i = 0; i < H2_NUMDCACHE; ++i) {
+		if (hfs->dcache[i].data_off == bref->data_off &&
+		    hfs->dcache[i].data != NULL) {
+			db = &hfs->dcache[i];
+			db->use = ++hfs->dcache_lru;
+			*pptr = db->data;
+			return(lsize);
+		}
+		if (db == NULL || db->use > hfs->dcache[i].use)
+			db = &hfs->dcache[i];
+	}
+	if (db->data == NULL && (db->data = malloc(HAMMER2_PBUFSIZE)) == NULL)
+		return(-1);
+	db->data_off = 0;
+
+	psize = blocksize(bref);
+	dev_bsize = psize;
+	if (dev_bsize < HAMMER2_LBUFSIZE)
+		dev_bsize = HAMMER2_LBUFSIZE;
+	dev_boff = blockoff(bref) - (blockoff(bref) & ~HAMMER2_LBUFMASK64);
+	if (h2read(hfs, &media, dev_bsize, blockoff(bref) - dev_boff))
+		return(-1);
+	saved_base.data_off = (hammer2_off_t)-1;
+	src = media.buf + dev_boff;
+
+	switch(HAMMER2_DEC_COMP(bref->methods)) {
+	case HAMMER2_COMP_LZ4:
+		/* the compressed length precedes the LZ4 stream */
+		bcopy(src, &clen, sizeof(clen));
+		if (clen < 0 || clen > psize - (int)sizeof(clen))
+			return(-1);
+		n = h2lz4_decompress(src + sizeof(clen), db->data,
+				     clen, HAMMER2_PBUFSIZE);
+		break;
+	case HAMMER2_COMP_ZLIB:
+		n = h2zlib_decompress(src, db->data, psize, HAMMER2_PBUFSIZE);
+		break;
+	default:
+		n = -1;
+		break;
+	}
+	if (n < 0)
+		return(-1);
+	if (n < lsize)
+		bzero(db->data + n, lsize - n);
+	db->data_off = bref->data_off;
+	db->use = ++hfs->dcache_lru;
+	*pptr = db->data;
+	return(lsize);
+#else
+	return(-1);
+#endif
+}
+
+#ifdef H2_MCACHE
+
+static
+void
+h2mfree(struct hammer2_fs *hfs, struct hammer2_mblock *mb)
+{
+	if (mb->data) {
+		free(mb->data);
+		hfs->mcache_bytes -= mb->bytes;
+	}
+	mb->data = NULL;
+	mb->data_off = 0;
+	mb->bytes = 0;
+}
+
+#endif
+
+/*
+ * Return the contents of the inode or indirect block (bref).  The data
+ * stays valid until the next h2bread() or h2lookup().
+ */
+static
+hammer2_media_data_t *
+h2bread(struct hammer2_fs *hfs, hammer2_blockref_t *bref)
+{
+#ifdef H2_MCACHE
+	struct hammer2_mblock *mb;
+	struct hammer2_mblock *lru;
+	size_t bytes;
+	int i;
+
+	lru = NULL;
+	for (i = 0; i < hfs->nmcache; ++i) {
+		mb = &hfs->mcache[i];
+		if (mb->data_off == bref->data_off && mb->data) {
+			mb->use = ++hfs->mcache_lru;
+			return(mb->data);
+		}
+		if (lru == NULL || lru->use > mb->use)
+			lru = mb;
+	}
+
+	/*
+	 * Recycle the least recently used entry, and more if we are
+	 * over the byte limit.
+	 */
+	bytes = blocksize(bref);
+	h2mfree(hfs, lru);
+	while (hfs->mcache_bytes + bytes > hfs->mcache_size) {
+		mb = NULL;
+		for (i = 0; i < hfs->nmcache; ++i) {
+			if (hfs->mcache[i].data == NULL)
+				continue;
+			if (mb == NULL || mb->use > hfs->mcache[i].use)
+				mb = &hfs->mcache[i];
+		}
+		if (mb == NULL)
+			break;
+		h2mfree(hfs, mb);
+	}
+	if ((lru->data = malloc(bytes)) == NULL)
+		return(NULL);
+	if (h2read(hfs, lru->data, bytes, blockoff(bref))) {
+		free(lru->data);
+		lru->data = NULL;
+		return(NULL);
+	}
+	hfs->mcache_bytes += bytes;
+	lru->bytes = bytes;
+	lru->data_off = bref->data_off;
+	lru->use = ++hfs->mcache_lru;
+	return(lru->data);
+#else
+	if (bref->data_off != saved_base.data_off) {
+		if (h2read(hfs, &media, blocksize(bref), blockoff(bref)))
+			return(NULL);
+		saved_base = *bref;
+	}
+	return(&media);
+#endif
+}
+
 /*
  * Lookup within the block specified by (*base), loading the block from disk
  * if necessary.  Locate the first key within the requested range and
@@ -272,6 +586,7 @@ h2lookup(struct hammer2_fs *hfs, hammer2_blockref_t *base,
 	 hammer2_key_t key_beg, hammer2_key_t key_end,
 	 hammer2_blockref_t *bref_ret, void **pptr)
 {
+	hammer2_media_data_t *bp;
 	hammer2_blockref_t *bref;
 	hammer2_blockref_t best;
 	hammer2_key_t scan_beg;
@@ -313,32 +628,28 @@ again:
 	best.key = HAMMER2_KEY_MAX;
 	best.type = 0;
 
-	for (i = 0; i < count; ++i) {
-		/*
-		 * [re]load when returning from our recursion
-		 */
-		if (base->type != HAMMER2_BREF_TYPE_VOLUME &&
-		    base->data_off != saved_base.data_off) {
-			if (h2read(hfs, &media,
-				   blocksize(base), blockoff(base))) {
-				return(-1);
-			}
-			saved_base = *base;
-		}
+	/*
+	 * [re]load when returning from our recursion
+	 */
+	bp = NULL;
+	if (base->type != HAMMER2_BREF_TYPE_VOLUME) {
+		if ((bp = h2bread(hfs, base)) == NULL)
+			return(-1);
+	}
 
-		/*
-		 * Special case embedded file data
-		 */
-		if (base->type == HAMMER2_BREF_TYPE_INODE) {
-			if (media.ipdata.meta.op_flags &
-			    HAMMER2_OPFLAG_DIRECTDATA) {
-				*pptr = media.ipdata.u.data;
-				bref_ret->type = HAMMER2_BREF_TYPE_DATA;
-				bref_ret->key = 0;
-				return HAMMER2_EMBEDDED_BYTES;
-			}
+	/*
+	 * Special case embedded file data
+	 */
+	if (base->type == HAMMER2_BREF_TYPE_INODE) {
+		if (bp->ipdata.meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA) {
+			*pptr = bp->ipdata.u.data;
+			bref_ret->type = HAMMER2_BREF_TYPE_DATA;
+			bref_ret->key = 0;
+			return HAMMER2_EMBEDDED_BYTES;
 		}
+	}
 
+	for (i = 0; i < count; ++i) {
 		/*
 		 * Calculate the bref in our scan.
 		 */
@@ -347,10 +658,10 @@ again:
 			bref = &hfs->sroot_blockset.blockref[i];
 			break;
 		case HAMMER2_BREF_TYPE_INODE:
-			bref = &media.ipdata.u.blockset.blockref[i];
+			bref = &bp->ipdata.u.blockset.blockref[i];
 			break;
 		case HAMMER2_BREF_TYPE_INDIRECT:
-			bref = &media.npdata[i];
+			bref = &bp->npdata[i];
 			break;
 		}
 		if (bref->type == 0)
@@ -392,9 +703,30 @@ again:
 		}
 		break;
 	case HAMMER2_BREF_TYPE_INODE:
+		/*
+		 * Terminal match on an inode, which h2bread() may cache.
+		 */
+		if ((bp = h2bread(hfs, &best)) == NULL)
+			return(-1);
+		*bref_ret = best;
+		*pptr = bp;
+		rc = blocksize(&best);
+		break;
 	case HAMMER2_BREF_TYPE_DATA:
 		/*
-		 * Terminal match.  Leaf elements might not be data-aligned.
+		 * Terminal match.  Compressed data is returned decompressed.
+		 */
+		if (best.type == HAMMER2_BREF_TYPE_DATA &&
+		    (HAMMER2_DEC_COMP(best.methods) == HAMMER2_COMP_LZ4 ||
+		     HAMMER2_DEC_COMP(best.methods) == HAMMER2_COMP_ZLIB)) {
+			rc = h2decompress(hfs, &best, pptr);
+			if (rc > 0)
+				*bref_ret = best;
+			break;
+		}
+
+		/*
+		 * Leaf elements might not be data-aligned.
 		 */
 		dev_bsize = blocksize(&best);
 		if (dev_bsize < HAMMER2_LBUFSIZE)
@@ -593,6 +925,32 @@ h2init(struct hammer2_fs *hfs)
 	 * XXX Probably still going to be problems w/ HAMMER2 volumes on
 	 *     media which is too small w/certain BIOSes.
 	 */
+#ifdef H2_COMPRESSION
+	for (i = 0; i < H2_NUMDCACHE; ++i) {
+		hfs->dcache[i].data_off = 0;
+		hfs->dcache[i].use = 0;
+		hfs->dcache[i].data = NULL;
+	}
+	hfs->dcache_lru = 0;
+#endif
+#ifdef H2_MCACHE
+	hfs->mcache_size = H2_MCACHE_SIZE;
+#ifdef LIBSTAND
+	if (getenv("hammer2.cache_size") != NULL)
+		hfs->mcache_size = strtol(getenv("hammer2.cache_size"),
+					  NULL, 0);
+#endif
+	hfs->nmcache = hfs->mcache_size / H2_MCACHE_AVG;
+	if (hfs->nmcache < H2_NUMMCACHE_MIN)
+		hfs->nmcache = H2_NUMMCACHE_MIN;
+	hfs->mcache = malloc(hfs->nmcache * sizeof(*hfs->mcache));
+	if (hfs->mcache == NULL)
+		return(-1);
+	bzero(hfs->mcache, hfs->nmcache * sizeof(*hfs->mcache));
+	hfs->mcache_lru = 0;
+	hfs->mcache_bytes = 0;
+#endif
+
 	best = -1;
 	for (i = 0; i < HAMMER2_NUM_VOLHDRS; ++i) {
 		off = i * HAMMER2_ZONE_BYTES64;
@@ -702,7 +1060,7 @@ const struct boot2_fsapi boot2_hammer2_api = {
 #ifdef LIBSTAND
 
 struct hfile {
-	struct hammer2_fs hfs;
+	struct hammer2_fs *hfs;
 	hammer2_blockref_t bref;
 	int64_t		fsize;
 	uint32_t	mode;
@@ -761,24 +1119,52 @@ hammer2_get_mode(uint8_t type)
 	}
 }
 
+static void hammer2_unmount(void *data);
+
+/*
+ * The hammer2_fs is shared by every file open on the volume, point its
+ * I/O at the file we are working for.
+ */
+static struct hammer2_fs *
+hfile_hfs(struct open_file *f)
+{
+	struct hfile *hf = f->f_fsdata;
+
+	hf->hfs->f = f;
+	return (hf->hfs);
+}
+
 static int
 hammer2_open(const char *path, struct open_file *f)
 {
 	struct hfile *hf = malloc(sizeof(*hf));
+	struct hammer2_fs *hfs;
 	hammer2_inode_data_t *ipdata;
 
 	bzero(hf, sizeof(*hf));
 	f->f_offset = 0;
 	f->f_fsdata = hf;
-	hf->hfs.f = f;
 
-	if (h2init(&hf->hfs)) {
-		f->f_fsdata = NULL;
-		free(hf);
-		errno = ENOENT;
-		return(-1);
+	/*
+	 * The volume header is kept by the mount cache, only go looking
+	 * for it the first time we see the volume.
+	 */
+	if ((hfs = f->f_mntdata) == NULL) {
+		hfs = malloc(sizeof(*hfs));
+		bzero(hfs, sizeof(*hfs));
+		hfs->f = f;
+		if (h2init(hfs)) {
+			f->f_fsdata = NULL;
+			hammer2_unmount(hfs);
+			free(hf);
+			errno = ENOENT;
+			return(-1);
+		}
+		f->f_mntdata = hfs;
 	}
-	h2resolve(&hf->hfs, path, &hf->bref, &ipdata);
+	hf->hfs = hfs;
+
+	h2resolve(hfile_hfs(f), path, &hf->bref, &ipdata);
 	if (hf->bref.data_off == (hammer2_off_t)-1 ||
 	    (hf->bref.type != HAMMER2_BREF_TYPE_INODE &&
 	    hf->bref.type != HAMMER2_BREF_TYPE_VOLUME)) {
@@ -797,6 +1183,7 @@ hammer2_open(const char *path, struct open_file *f)
 		hf->type = HAMMER2_OBJTYPE_DIRECTORY;
 		hf->mode = 0755 | S_IFDIR;
 	}
+	f->f_rasize = HAMMER2_PBUFSIZE;
 	return(0);
 }
 
@@ -811,6 +1198,24 @@ hammer2_close(struct open_file *f)
 	return (0);
 }
 
+static void
+hammer2_unmount(void *data)
+{
+	struct hammer2_fs *hfs = data;
+	int i;
+
+	for (i = 0; i < H2_NUMDCACHE; ++i) {
+		if (hfs->dcache[i].data)
+			free(hfs->dcache[i].data);
+	}
+	if (hfs->mcache) {
+		for (i = 0; i < hfs->nmcache; ++i)
+			h2mfree(hfs, &hfs->mcache[i]);
+		free(hfs->mcache);
+	}
+	free(hfs);
+}
+
 static int
 hammer2_read(struct open_file *f, void *buf, size_t len, size_t *resid)
 {
@@ -818,7 +1223,7 @@ hammer2_read(struct open_file *f, void *buf, size_t len, size_t *resid)
 	ssize_t total;
 	int rc = 0;
 
-	total = h2readfile(&hf->hfs, &hf->bref,
+	total = h2readfile(hfile_hfs(f), &hf->bref,
 			   f->f_offset, hf->fsize, buf, len);
 	if (total < 0) {
 		rc = EIO;
@@ -874,7 +1279,7 @@ hammer2_readdir(struct open_file *f, struct dirent *den)
 	int bytes;
 
 	for (;;) {
-		bytes = h2lookup(&hf->hfs, &hf->bref,
+		bytes = h2lookup(hfile_hfs(f), &hf->bref,
 				 f->f_offset | HAMMER2_DIRHASH_VISIBLE,
 				 HAMMER2_KEY_MAX,
 				 &bres, (void **)&ipdata);
@@ -901,7 +1306,8 @@ struct fs_ops hammer_fsops = {
 	null_write,
 	hammer2_seek,
 	hammer2_stat,
-	hammer2_readdir
+	hammer2_readdir,
+	hammer2_unmount
 };
 
 #endif
@@ -45,6 +45,8 @@ struct iodesc {
 	u_long	xid;			/* transaction identification */
 	u_char	myea[6];		/* my ethernet address */
 	struct netif *io_netif;
+	int	srtt;			/* smoothed rtt, ms << 3 */
+	int	rttvar;			/* rtt mean deviation, ms << 2 */
 };
 
 #endif /* __SYS_LIBNETBOOT_IODESC_H */
@@ -132,9 +132,10 @@ lseek(int fd, off_t offset, int where)
 	offset -= f->f_ralen;
 
     /*
-     * Invalidate the readahead buffer.
+     * Invalidate the readahead buffer, the next fill is not sequential.
      */
     f->f_ralen = 0;
+    f->f_raoffset = 0;
 
     return (f->f_ops->fo_seek)(f, offset, where);
 }
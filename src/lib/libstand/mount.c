@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Mount cache.
+ *
+ * A file system with an fo_unmount method may leave its per-device state
+ * (superblock, volume header, metadata buffers) in f_mntdata when its
+ * fo_open recognises the device.  open() hands that state to us and we
+ * keep it keyed on the device name, so the next open on the same device
+ * goes straight to the file system that claimed it and skips the probe.
+ *
+ * Entries are reference counted by the open files using them.  Flushing
+ * unlinks every entry; those still in use are released on last close.
+ * Mounts on removable media (F_VOLATILE) are never shared, so they go
+ * away with the last file using them and a swapped disk is probed anew.
+ */
+
+#include "stand.h"
+
+static struct fs_mount	*mount_list;
+
+static void
+mount_free(struct fs_mount *m)
+{
+    m->m_ops->fo_unmount(m->m_data);
+    if (m->m_devname != NULL)
+	free(m->m_devname);
+    free(m);
+}
+
+/*
+ * Find the cached mount for the device (f) is open on.
+ */
+struct fs_mount *
+mount_lookup(struct open_file *f)
+{
+    struct fs_mount	*m;
+    char		*name;
+
+    if ((name = devformat(f)) == NULL)
+	return(NULL);
+    for (m = mount_list; m != NULL; m = m->m_next) {
+	if (m->m_dev == f->f_dev && !strcmp(m->m_devname, name))
+	    return(m);
+    }
+    return(NULL);
+}
+
+/*
+ * Take over the f_mntdata (ops) just set up for (f) and attach (f) to it.
+ * Removable media and devices that can't be named get a private entry
+ * which goes away with the file.  Returns NULL if out of memory,
+ * leaving f_mntdata to the caller.
+ */
+struct fs_mount *
+mount_insert(struct open_file *f, struct fs_ops *ops)
+{
+    struct fs_mount	*m;
+    char		*name;
+
+    if ((m = malloc(sizeof(*m))) == NULL)
+	return(NULL);
+    m->m_dev = f->f_dev;
+    m->m_ops = ops;
+    m->m_data = f->f_mntdata;
+    m->m_refs = 0;
+    m->m_next = NULL;
+    m->m_devname = NULL;
+    if (!(f->f_flags & F_VOLATILE) && (name = devformat(f)) != NULL)
+	m->m_devname = strdup(name);
+    if (m->m_devname != NULL) {
+	m->m_stale = 0;
+	m->m_next = mount_list;
+	mount_list = m;
+    } else {
+	m->m_stale = 1;
+    }
+    mount_attach(f, m);
+    return(m);
+}
+
+void
+mount_attach(struct open_file *f, struct fs_mount *m)
+{
+    m->m_refs++;
+    f->f_mount = m;
+    f->f_mntdata = m->m_data;
+}
+
+void
+mount_detach(struct open_file *f)
+{
+    struct fs_mount	*m;
+
+    if ((m = f->f_mount) == NULL)
+	return;
+    f->f_mount = NULL;
+    f->f_mntdata = NULL;
+    if (--m->m_refs == 0 && m->m_stale)
+	mount_free(m);
+}
+
+/*
+ * Forget everything we know about mounted devices, eg. because the media
+ * may have changed underneath us.
+ */
+void
+mount_flush(void)
+{
+    struct fs_mount	*m;
+
+    while ((m = mount_list) != NULL) {
+	mount_list = m->m_next;
+	m->m_next = NULL;
+	m->m_stale = 1;
+	if (m->m_refs == 0)
+	    mount_free(m);
+    }
+}
@@ -56,16 +56,80 @@
 
 n_long ip_convertaddr(char *p);
 
+/*
+ * Retransmit statistics, for the netstat command.  Protocols that keep
+ * several requests in flight (nfs) count their own.
+ */
+u_int	net_sends;
+u_int	net_retransmits;
+u_int	net_timeouts;
+u_int	net_replies;
+
+/*
+ * Retransmit timeout for (d).  As in TCP (Jacobson/Karels) we keep a
+ * smoothed round trip time and its mean deviation per descriptor and
+ * wait for srtt + 4 * rttvar, but never less than MINRTO.  Until the
+ * first reply has been timed we start from MINTMO.
+ */
+u_int
+rtt_rto(struct iodesc *d)
+{
+	int rto;
+
+	if (d->srtt == 0)
+		return (MINTMO * 1000);
+	rto = (d->srtt >> 3) + d->rttvar;
+	if (rto < MINRTO)
+		rto = MINRTO;
+	if (rto > MAXTMO * 1000)
+		rto = MAXTMO * 1000;
+	return (rto);
+}
+
+/*
+ * Fold a round trip measurement of (m) milliseconds into (d).
+ */
+void
+rtt_update(struct iodesc *d, u_int m)
+{
+	int delta;
+
+	if (m == 0)
+		m = 1;
+	if (d->srtt == 0) {
+		d->srtt = m << 3;
+		d->rttvar = m << 1;
+		return;
+	}
+	delta = (int)m - (d->srtt >> 3);
+	d->srtt += delta;			/* srtt += delta / 8 */
+	if (delta < 0)
+		delta = -delta;
+	d->rttvar += delta - (d->rttvar >> 2);	/* += (|delta| - rttvar) / 4 */
+	if (d->srtt <= 0)
+		d->srtt = 1;
+}
+
 /*
  * Send a packet and wait for a reply, with exponential backoff.
  *
+ * The timeout starts out at the round trip estimate for (d) and doubles
+ * with each retransmit, up to MAXTMO seconds; once a wait that long has
+ * gone unanswered we give up with ETIMEDOUT.  Only replies to requests
+ * that were sent once update the estimate, since we can't tell which
+ * copy of a retransmitted request was answered (Karn).
+ *
  * The send routine must return the actual number of bytes written,
- * or -1 on error.
+ * or -1 on error.  It may return 0 if it sent nothing and only wants
+ * the wait (tftp inside a window); that counts neither as a send nor
+ * as a round trip sample.
  *
  * The receive routine can indicate success by returning the number of
  * bytes read; it can return 0 to indicate EOF; it can return -1 with a
  * non-zero errno to indicate failure; finally, it can return -1 with a
- * zero errno to indicate it isn't done yet.
+ * zero errno to indicate it isn't done yet.  It is passed the time left
+ * in whole seconds, which is 0 when less than a second remains; it must
+ * still poll at least once in that case.
  */
 ssize_t
 sendrecv(struct iodesc *d, ssize_t (*sproc)(struct iodesc *, void *, size_t),
@@ -74,55 +138,90 @@ sendrecv(struct iodesc *d, ssize_t (*sproc)(struct iodesc *, void *, size_t),
 	 size_t rsize)
 {
 	ssize_t cc;
-	time_t t, tmo, tlast;
-	long tleft;
+	u_int rto, tsent, tsend, elapsed, tleft;
+	int tries, nsent;
 
 #ifdef NET_DEBUG
 	if (debug)
 		printf("sendrecv: called\n");
 #endif
 
-	tmo = MINTMO;
-	tlast = 0;
+	rto = rtt_rto(d);
+	tries = 0;
+	nsent = 0;
+	tsent = 0;
+	tsend = 0;
 	tleft = 0;
-	t = getsecs();
 	for (;;) {
-		if (tleft <= 0) {
-			if (tmo >= MAXTMO) {
-				errno = ETIMEDOUT;
-				return -1;
+		if (tleft == 0) {
+			if (tries > 0) {
+				if (rto >= MAXTMO * 1000) {
+					net_timeouts++;
+					errno = ETIMEDOUT;
+					return -1;
+				}
+				if (nsent > 0)
+					net_retransmits++;
+				rto <<= 1;
+				if (rto > MAXTMO * 1000)
+					rto = MAXTMO * 1000;
 			}
 			cc = (*sproc)(d, sbuf, ssize);
 			if (cc != -1 && cc < ssize)
 				panic("sendrecv: short write! (%zd < %zd)",
 				    cc, ssize);
 
-			tleft = tmo;
-			tmo += MINTMO;
-			if (tmo > MAXTMO)
-				tmo = MAXTMO;
+			tries++;
+			tsent = getmsecs();
+			if (cc != 0) {
+				nsent++;
+				net_sends++;
+				tsend = tsent;
+			}
+			tleft = rto;
 
 			if (cc == -1) {
 				/* Error on transmit; wait before retrying */
-				while ((getsecs() - t) < tmo)
+				while ((getmsecs() - tsent) < rto)
 					;
 				tleft = 0;
 				continue;
 			}
-
-			tlast = t;
 		}
 
 		/* Try to get a packet and process it. */
-		cc = (*rproc)(d, rbuf, rsize, tleft);
+		cc = (*rproc)(d, rbuf, rsize, tleft / 1000);
 		/* Return on data, EOF or real error. */
-		if (cc != -1 || errno != 0)
+		if (cc != -1 || errno != 0) {
+			if (cc != -1) {
+				net_replies++;
+				if (nsent == 1)
+					rtt_update(d, getmsecs() - tsend);
+			}
 			return (cc);
+		}
 
 		/* Timed out or didn't get the packet we're waiting for */
-		t = getsecs();
-		tleft -= t - tlast;
-		tlast = t;
+		elapsed = getmsecs() - tsent;
+		tleft = (elapsed < rto) ? rto - elapsed : 0;
+	}
+}
+
+void
+netstats(void)
+{
+	struct iodesc *d;
+	int i;
+
+	printf("%u requests sent, %u retransmitted, %u timed out\n",
+	       net_sends, net_retransmits, net_timeouts);
+	printf("%u replies\n", net_replies);
+	for (i = 0; i < SOPEN_MAX; i++) {
+		d = &sockets[i];
+		if (d->io_netif == NULL || d->srtt == 0)
+			continue;
+		printf("socket %d: srtt %d ms, rttvar %d ms, rto %u ms\n",
+		       i, d->srtt >> 3, d->rttvar >> 2, rtt_rto(d));
 	}
 }
 
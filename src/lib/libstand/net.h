@@ -52,6 +52,7 @@
 
 #define MAXTMO 120	/* seconds */
 #define MINTMO 2	/* seconds */
+#define MINRTO 100	/* milliseconds */
 
 #define FNAME_SIZE 128
 #define	IFNAME_SIZE 16
@@ -83,6 +84,7 @@ extern	struct in_addr swapip;
 extern	struct in_addr gateip;
 extern	struct in_addr nameip;
 extern	n_long netmask;
+extern	size_t udp_maxdata;		/* largest UDP payload, 0 if no limit */
 
 extern	int debug;			/* defined in the machdep sources */
 
@@ -118,3 +120,12 @@ n_long	inet_addr(char *);
 
 /* Machine-dependent functions: */
 time_t	getsecs(void);
+u_int	getmsecs(void);
+
+/* Round trip estimation and retransmit statistics (net.c): */
+u_int	rtt_rto(struct iodesc *);
+void	rtt_update(struct iodesc *, u_int);
+extern	u_int net_sends;
+extern	u_int net_retransmits;
+extern	u_int net_timeouts;
+extern	u_int net_replies;
@@ -67,42 +67,62 @@ struct nfsv2_fattrs {
 	struct nfsv2_time fa_ctime;
 };
 
+/* NFSv3 fattr3, 64 bit quantities as two words, high word first. */
+struct nfsv3_time {
+	n_long	nfs_sec;
+	n_long	nfs_nsec;
+};
 
-struct nfs_read_args {
-	u_char	fh[NFS_FHSIZE];
-	n_long	off;
-	n_long	len;
-	n_long	xxx;			/* XXX what's this for? */
+struct nfsv3_fattrs {
+	n_long	fa_type;
+	n_long	fa_mode;
+	n_long	fa_nlink;
+	n_long	fa_uid;
+	n_long	fa_gid;
+	n_long	fa_size[2];
+	n_long	fa_used[2];
+	n_long	fa_rdev[2];
+	n_long	fa_fsid[2];
+	n_long	fa_fileid[2];
+	struct nfsv3_time fa_atime;
+	struct nfsv3_time fa_mtime;
+	struct nfsv3_time fa_ctime;
+};
+
+/*
+ * The attributes we keep, in host order, whichever version of the
+ * protocol they came from.
+ */
+struct nfs_attr {
+	n_long	type;
+	n_long	mode;
+	n_long	nlink;
+	n_long	uid;
+	n_long	gid;
+	u_int64_t size;
 };
 
 /*
  * Data part of nfs rpc reply (also the largest thing we receive).
- * Worry about the size of the structure declared on the stack.
+ * The buffer is allocated once nfs.read_size is known.  Sizes above
+ * what fits in one ethernet frame need the server's reply to be
+ * reassembled from IP fragments.  libstand's udp.c does that; a netif
+ * with its own readudp() (pxeboot) may not, and it limits the size
+ * through udp_maxdata.
  */
 
 #define NFSREAD_MIN_SIZE 1024
-#define NFSREAD_MAX_SIZE 4096
-
-struct nfs_read_repl {
-	n_long	errno;
-	struct	nfsv2_fattrs fa;
-	n_long	count;
-	u_char	data[NFSREAD_MAX_SIZE];
-};
+#define NFSREAD_MAX_SIZE NFS_MAXDGRAMDATA
+#define NFSREAD_V3_MAX_SIZE 32768
+#define NFSREAD_OVERHEAD \
+	(RPC_HEADER_WORDS * sizeof(n_long) + NFSX_V3FATTR + 32)
 
-#ifndef NFS_NOSYMLINK
-struct nfs_readlnk_repl {
-	n_long	errno;
-	n_long	len;
-	char	path[NFS_MAXPATHLEN];
-};
-#endif
-
-struct nfs_readdir_args {
-	u_char	fh[NFS_FHSIZE];
-	n_long	cookie;
-	n_long	count;
-};
+/*
+ * READs nfs_read() keeps in flight for large requests, tunable with
+ * nfs.read_pipeline; 1 does them one at a time.
+ */
+#define NFS_READ_PIPE		4
+#define NFS_READ_MAXPIPE	16
 
 struct nfs_readdir_data {
 	n_long	fileid;
@@ -115,11 +135,25 @@ struct nfs_readdir_off {
 	n_long	follows;
 };
 
+/*
+ * Keep iodesc, off and fh first, pxe.c peeks at nfs_root_node.
+ */
 struct nfs_iodesc {
 	struct	iodesc	*iodesc;
 	off_t	off;
-	u_char	fh[NFS_FHSIZE];
-	struct nfsv2_fattrs fa;	/* all in network order */
+	u_char	fh[NFS_V3MAXFHSIZE];
+	int	fhsize;		/* always NFS_FHSIZE for v2 */
+	struct nfs_attr fa;
+};
+
+/*
+ * Cursor for taking apart the variable length parts of a reply.
+ * Running off the end sets x_error and yields zeroes from then on.
+ */
+struct nfs_xdr {
+	n_long	*x_p;
+	n_long	*x_end;
+	int	x_error;
 };
 
 /*
@@ -134,7 +168,8 @@ static off_t	nfs_seek(struct open_file *f, off_t offset, int where);
 static int	nfs_stat(struct open_file *f, struct stat *sb);
 static int	nfs_readdir(struct open_file *f, struct dirent *d);
 
-int		nfs_getrootfh(struct iodesc *d, char *path, u_char *fhp);
+int		nfs_getrootfh(struct iodesc *d, char *path, u_char *fhp,
+		    int *fhsizep);
 
 struct	nfs_iodesc nfs_root_node;
 
@@ -150,32 +185,153 @@ struct fs_ops nfs_fsops = {
 };
 
 static int nfs_read_size = NFSREAD_MIN_SIZE;
+static int nfs_read_pipe = NFS_READ_PIPE;
+static n_long *nfs_read_buf;	/* READ replies, sized for nfs_read_size */
+static size_t nfs_read_buflen;
+static int nfs_version = NFS_VER3;	/* what the server's mountd took */
+
+static void
+xdr_init(struct nfs_xdr *x, void *buf, ssize_t len)
+{
+	x->x_p = buf;
+	x->x_end = (n_long *)((char *)buf + (len & ~3));
+	x->x_error = 0;
+}
+
+static n_long
+xdr_get(struct nfs_xdr *x)
+{
+	if (x->x_error || x->x_p >= x->x_end) {
+		x->x_error = EBADRPC;
+		return (0);
+	}
+	return (ntohl(*x->x_p++));
+}
+
+static u_int64_t
+xdr_get64(struct nfs_xdr *x)
+{
+	u_int64_t v;
+
+	v = (u_int64_t)xdr_get(x) << 32;
+	return (v | xdr_get(x));
+}
+
+/* Step over len bytes of opaque data, returning where they start. */
+static void *
+xdr_opaque(struct nfs_xdr *x, size_t len)
+{
+	void *p;
+
+	if (x->x_error ||
+	    len > (size_t)((char *)x->x_end - (char *)x->x_p)) {
+		x->x_error = EBADRPC;
+		return (NULL);
+	}
+	p = x->x_p;
+	x->x_p += roundup(len, 4) / 4;
+	return (p);
+}
+
+static void
+nfs_attr_v2(struct nfs_attr *fa, struct nfsv2_fattrs *f2)
+{
+	fa->type  = ntohl(f2->fa_type);
+	fa->mode  = ntohl(f2->fa_mode);
+	fa->nlink = ntohl(f2->fa_nlink);
+	fa->uid   = ntohl(f2->fa_uid);
+	fa->gid   = ntohl(f2->fa_gid);
+	fa->size  = ntohl(f2->fa_size);
+}
+
+static void
+nfs_attr_v3(struct nfs_attr *fa, struct nfsv3_fattrs *f3)
+{
+	fa->type  = ntohl(f3->fa_type);
+	fa->mode  = ntohl(f3->fa_mode);
+	fa->nlink = ntohl(f3->fa_nlink);
+	fa->uid   = ntohl(f3->fa_uid);
+	fa->gid   = ntohl(f3->fa_gid);
+	fa->size  = ((u_int64_t)ntohl(f3->fa_size[0]) << 32) |
+	    ntohl(f3->fa_size[1]);
+}
+
+/*
+ * NFSv3 post_op_attr.  Returns 1 and fills in fa (if not NULL) when the
+ * server sent attributes.
+ */
+static int
+nfs_xdr_postop_attr(struct nfs_xdr *x, struct nfs_attr *fa)
+{
+	struct nfsv3_fattrs *f3;
+
+	if (xdr_get(x) == 0)
+		return (0);
+	f3 = xdr_opaque(x, sizeof(*f3));
+	if (f3 == NULL)
+		return (0);
+	if (fa != NULL)
+		nfs_attr_v3(fa, f3);
+	return (1);
+}
+
+/* NFSv3 nfs_fh3, a counted file handle */
+static void
+nfs_xdr_fh(struct nfs_xdr *x, u_char *fh, int *fhsizep)
+{
+	n_long len;
+	void *p;
+
+	len = xdr_get(x);
+	if (len > NFS_V3MAXFHSIZE) {
+		x->x_error = EBADRPC;
+		return;
+	}
+	if ((p = xdr_opaque(x, len)) == NULL)
+		return;
+	bcopy(p, fh, len);
+	*fhsizep = len;
+}
 
 /*
- * Fetch the root file handle (call mount daemon)
+ * Put the file handle into a request: fixed size in v2, counted in v3.
+ * Returns the next free word.
+ */
+static n_long *
+nfs_put_fh(struct nfs_iodesc *d, n_long *p)
+{
+	if (nfs_version == NFS_VER3)
+		*p++ = htonl(d->fhsize);
+	bcopy(d->fh, p, d->fhsize);
+	return (p + roundup(d->fhsize, 4) / 4);
+}
+
+/*
+ * Fetch the root file handle (call mount daemon).  Ask for a v3 mount
+ * first and settle for v1 (and thus NFSv2) if the server won't.
  * Return zero or error number.
  */
 int
-nfs_getrootfh(struct iodesc *d, char *path, u_char *fhp)
+nfs_getrootfh(struct iodesc *d, char *path, u_char *fhp, int *fhsizep)
 {
 	int len;
 	struct args {
 		n_long	len;
 		char	path[FNAME_SIZE];
 	} *args;
-	struct repl {
-		n_long	errno;
-		u_char	fh[NFS_FHSIZE];
-	} *repl;
 	struct {
 		n_long	h[RPC_HEADER_WORDS];
 		struct args d;
 	} sdata;
 	struct {
 		n_long	h[RPC_HEADER_WORDS];
-		struct repl d;
+		n_long	d[(NFS_V3MAXFHSIZE + 256) / 4];
 	} rdata;
-	size_t cc;
+	struct nfs_xdr x;
+	ssize_t cc;
+	n_long status;
+	int maxread;
+	u_char *fh;
 
 #ifdef NFS_DEBUG
 	if (debug)
@@ -183,7 +339,6 @@ nfs_getrootfh(struct iodesc *d, char *path, u_char *fhp)
 #endif
 
 	args = &sdata.d;
-	repl = &rdata.d;
 
 	bzero(args, sizeof(*args));
 	len = strlen(path);
@@ -193,27 +348,64 @@ nfs_getrootfh(struct iodesc *d, char *path, u_char *fhp)
 	bcopy(path, args->path, len);
 	len = 4 + roundup(len, 4);
 
-	cc = rpc_call(d, RPCPROG_MNT, RPCMNT_VER1, RPCMNT_MOUNT,
-	    args, len, repl, sizeof(*repl));
+	nfs_version = NFS_VER3;
+	cc = rpc_call(d, RPCPROG_MNT, RPCMNT_VER3, RPCMNT_MOUNT,
+	    args, len, rdata.d, sizeof(rdata.d));
+	if (cc == -1 && (errno == EPROGUNAVAIL || errno == EPROGMISMATCH ||
+	    errno == EBADRPC)) {
+		nfs_version = NFS_VER2;
+		cc = rpc_call(d, RPCPROG_MNT, RPCMNT_VER1, RPCMNT_MOUNT,
+		    args, len, rdata.d, sizeof(rdata.d));
+	}
 	if (cc == -1) {
 		/* errno was set by rpc_call */
 		return (errno);
 	}
-	if (cc < 4)
+	xdr_init(&x, rdata.d, cc);
+	status = xdr_get(&x);
+	if (x.x_error)
+		return (EBADRPC);
+	if (status)
+		return (status);
+	if (nfs_version == NFS_VER3) {
+		nfs_xdr_fh(&x, fhp, fhsizep);
+	} else if ((fh = xdr_opaque(&x, NFS_FHSIZE)) != NULL) {
+		bcopy(fh, fhp, NFS_FHSIZE);
+		*fhsizep = NFS_FHSIZE;
+	}
+	if (x.x_error)
 		return (EBADRPC);
-	if (repl->errno)
-		return (ntohl(repl->errno));
-	bcopy(repl->fh, fhp, sizeof(repl->fh));
 
 	/*
 	 * Improve boot performance over NFS
 	 */
+	maxread = nfs_version == NFS_VER3 ?
+	    NFSREAD_V3_MAX_SIZE : NFSREAD_MAX_SIZE;
 	if (getenv("nfs.read_size") != NULL)
 		nfs_read_size = strtol(getenv("nfs.read_size"), NULL, 0);
 	if (nfs_read_size < NFSREAD_MIN_SIZE)
 		nfs_read_size = NFSREAD_MIN_SIZE;
-	if (nfs_read_size > NFSREAD_MAX_SIZE)
-		nfs_read_size = NFSREAD_MAX_SIZE;
+	/* a READ reply has to fit what readudp() can take, eg. on pxeboot */
+	if (udp_maxdata != 0 && maxread > udp_maxdata - NFSREAD_OVERHEAD)
+		maxread = (udp_maxdata - NFSREAD_OVERHEAD) & ~511;
+	if (nfs_read_size > maxread)
+		nfs_read_size = maxread;
+	if (getenv("nfs.read_pipeline") != NULL)
+		nfs_read_pipe = strtol(getenv("nfs.read_pipeline"), NULL, 0);
+	if (nfs_read_pipe < 1)
+		nfs_read_pipe = 1;
+	if (nfs_read_pipe > NFS_READ_MAXPIPE)
+		nfs_read_pipe = NFS_READ_MAXPIPE;
+
+	len = NFSREAD_OVERHEAD + nfs_read_size;
+	if (nfs_read_buflen < len) {
+		if (nfs_read_buf != NULL)
+			free(nfs_read_buf);
+		nfs_read_buflen = 0;
+		if ((nfs_read_buf = malloc(len)) == NULL)
+			return (ENOMEM);
+		nfs_read_buflen = len;
+	}
 
 	return (0);
 }
@@ -225,25 +417,18 @@ nfs_getrootfh(struct iodesc *d, char *path, u_char *fhp)
 static int
 nfs_lookupfh(struct nfs_iodesc *d, const char *name, struct nfs_iodesc *newfd)
 {
-	int len, rlen;
-	struct args {
-		u_char	fh[NFS_FHSIZE];
-		n_long	len;
-		char	name[FNAME_SIZE];
-	} *args;
-	struct repl {
-		n_long	errno;
-		u_char	fh[NFS_FHSIZE];
-		struct	nfsv2_fattrs fa;
-	} *repl;
+	int len;
 	struct {
 		n_long	h[RPC_HEADER_WORDS];
-		struct args d;
+		n_long	d[(NFS_V3MAXFHSIZE + FNAME_SIZE) / 4 + 2];
 	} sdata;
 	struct {
 		n_long	h[RPC_HEADER_WORDS];
-		struct repl d;
+		n_long	d[(NFS_V3MAXFHSIZE + 2 * NFSX_V3FATTR) / 4 + 8];
 	} rdata;
+	struct nfs_xdr x;
+	n_long *p, status;
+	void *fh, *fa;
 	ssize_t cc;
 
 #ifdef NFS_DEBUG
@@ -251,33 +436,44 @@ nfs_lookupfh(struct nfs_iodesc *d, const char *name, struct nfs_iodesc *newfd)
 		printf("lookupfh: called\n");
 #endif
 
-	args = &sdata.d;
-	repl = &rdata.d;
-
-	bzero(args, sizeof(*args));
-	bcopy(d->fh, args->fh, sizeof(args->fh));
+	p = nfs_put_fh(d, sdata.d);
 	len = strlen(name);
-	if (len > sizeof(args->name))
-		len = sizeof(args->name);
-	bcopy(name, args->name, len);
-	args->len = htonl(len);
-	len = 4 + roundup(len, 4);
-	len += NFS_FHSIZE;
-
-	rlen = sizeof(*repl);
-
-	cc = rpc_call(d->iodesc, NFS_PROG, NFS_VER2, NFSPROC_LOOKUP,
-	    args, len, repl, rlen);
+	if (len > FNAME_SIZE)
+		len = FNAME_SIZE;
+	*p++ = htonl(len);
+	if (len & 3)
+		p[len / 4] = 0;		/* zero the padding */
+	bcopy(name, p, len);
+	p += roundup(len, 4) / 4;
+
+	cc = rpc_call(d->iodesc, NFS_PROG, nfs_version,
+	    nfs_version == NFS_VER3 ? NFSPROCV3_LOOKUP : NFSPROC_LOOKUP,
+	    sdata.d, (char *)p - (char *)sdata.d, rdata.d, sizeof(rdata.d));
 	if (cc == -1)
 		return (errno);		/* XXX - from rpc_call */
-	if (cc < 4)
+	xdr_init(&x, rdata.d, cc);
+	status = xdr_get(&x);
+	if (x.x_error)
 		return (EIO);
-	if (repl->errno) {
+	if (status) {
 		/* saerrno.h now matches NFS error numbers. */
-		return (ntohl(repl->errno));
+		return (status);
+	}
+	if (nfs_version == NFS_VER3) {
+		nfs_xdr_fh(&x, newfd->fh, &newfd->fhsize);
+		if (!nfs_xdr_postop_attr(&x, &newfd->fa) && !x.x_error)
+			return (EIO);	/* we need at least the type */
+	} else {
+		fh = xdr_opaque(&x, NFS_FHSIZE);
+		fa = xdr_opaque(&x, sizeof(struct nfsv2_fattrs));
+		if (fa != NULL) {
+			bcopy(fh, newfd->fh, NFS_FHSIZE);
+			newfd->fhsize = NFS_FHSIZE;
+			nfs_attr_v2(&newfd->fa, fa);
+		}
 	}
-	bcopy( repl->fh, &newfd->fh, sizeof(newfd->fh));
-	bcopy(&repl->fa, &newfd->fa, sizeof(newfd->fa));
+	if (x.x_error)
+		return (EIO);
 	return (0);
 }
 
@@ -290,12 +486,15 @@ nfs_readlink(struct nfs_iodesc *d, char *buf)
 {
 	struct {
 		n_long	h[RPC_HEADER_WORDS];
-		u_char fh[NFS_FHSIZE];
+		n_long	d[NFS_V3MAXFHSIZE / 4 + 1];
 	} sdata;
 	struct {
 		n_long	h[RPC_HEADER_WORDS];
-		struct nfs_readlnk_repl d;
+		n_long	d[(NFSX_V3FATTR + NFS_MAXPATHLEN) / 4 + 4];
 	} rdata;
+	struct nfs_xdr x;
+	n_long *p, status, len;
+	void *path;
 	ssize_t cc;
 
 #ifdef NFS_DEBUG
@@ -303,29 +502,111 @@ nfs_readlink(struct nfs_iodesc *d, char *buf)
 		printf("readlink: called\n");
 #endif
 
-	bcopy(d->fh, sdata.fh, NFS_FHSIZE);
-	cc = rpc_call(d->iodesc, NFS_PROG, NFS_VER2, NFSPROC_READLINK,
-		      sdata.fh, NFS_FHSIZE,
-		      &rdata.d, sizeof(rdata.d));
+	p = nfs_put_fh(d, sdata.d);
+	cc = rpc_call(d->iodesc, NFS_PROG, nfs_version,
+	    nfs_version == NFS_VER3 ? NFSPROCV3_READLINK : NFSPROC_READLINK,
+	    sdata.d, (char *)p - (char *)sdata.d,
+	    rdata.d, sizeof(rdata.d));
 	if (cc == -1)
 		return (errno);
 
-	if (cc < 4)
+	xdr_init(&x, rdata.d, cc);
+	status = xdr_get(&x);
+	if (nfs_version == NFS_VER3)
+		nfs_xdr_postop_attr(&x, NULL);
+	if (x.x_error)
 		return (EIO);
 
-	if (rdata.d.errno)
-		return (ntohl(rdata.d.errno));
+	if (status)
+		return (status);
 
-	rdata.d.len = ntohl(rdata.d.len);
-	if (rdata.d.len > NFS_MAXPATHLEN)
+	len = xdr_get(&x);
+	if (len > NFS_MAXPATHLEN)
 		return (ENAMETOOLONG);
+	if ((path = xdr_opaque(&x, len)) == NULL)
+		return (EIO);
 
-	bcopy(rdata.d.path, buf, rdata.d.len);
-	buf[rdata.d.len] = 0;
+	bcopy(path, buf, len);
+	buf[len] = 0;
 	return (0);
 }
 #endif
 
+/*
+ * Put a READ of len bytes at off into a request.
+ * Returns the next free word, or NULL (and sets errno).
+ */
+static n_long *
+nfs_mkread(struct nfs_iodesc *d, n_long *p, off_t off, size_t len)
+{
+	p = nfs_put_fh(d, p);
+	if (nfs_version == NFS_VER3) {
+		*p++ = htonl((u_int64_t)off >> 32);
+		*p++ = htonl((n_long)off);
+		*p++ = htonl((n_long)len);
+	} else {
+		if (off > 0xffffffffLL) {
+			errno = EFBIG;
+			return (NULL);
+		}
+		*p++ = htonl((n_long)off);
+		*p++ = htonl((n_long)len);
+		*p++ = htonl((n_long)0);	/* totalcount, unused */
+	}
+	return (p);
+}
+
+/*
+ * Take apart the cc byte READ reply at rdata and copy at most len bytes
+ * of data to addr.  *eofp tells whether the server has no more data
+ * past this.  Return transfer count or -1 (and set errno)
+ */
+static ssize_t
+nfs_readreply(n_long *rdata, ssize_t cc, void *addr, size_t len, int *eofp)
+{
+	struct nfs_xdr x;
+	n_long status;
+	size_t count;
+	void *data;
+	int eof;
+
+	eof = 0;
+	xdr_init(&x, rdata, cc);
+	status = xdr_get(&x);
+	if (nfs_version == NFS_VER3) {
+		nfs_xdr_postop_attr(&x, NULL);
+		if (status == 0) {
+			xdr_get(&x);		/* count */
+			eof = xdr_get(&x);
+		}
+	} else if (status == 0) {
+		xdr_opaque(&x, sizeof(struct nfsv2_fattrs));
+	}
+	if (x.x_error) {
+		errno = EBADRPC;
+		return (-1);
+	}
+	if (status) {
+		errno = status;
+		return (-1);
+	}
+	count = xdr_get(&x);
+	data = xdr_opaque(&x, count);
+	if (data == NULL || count > len) {
+		printf("nfsread: short packet, %ld < %lu\n", (long)cc,
+		    (u_long)count);
+		errno = EBADRPC;
+		return(-1);
+	}
+	bcopy(data, addr, count);
+
+	/* v2 has no eof flag, a short read is all it can tell us */
+	if (nfs_version != NFS_VER3 && count < len)
+		eof = 1;
+	*eofp = eof || count == 0;
+	return (count);
+}
+
 /*
  * Read data from a file.
  * Return transfer count or -1 (and set errno)
@@ -333,55 +614,191 @@ nfs_readlink(struct nfs_iodesc *d, char *buf)
 static ssize_t
 nfs_readdata(struct nfs_iodesc *d, off_t off, void *addr, size_t len)
 {
-	struct nfs_read_args *args;
-	struct nfs_read_repl *repl;
 	struct {
 		n_long	h[RPC_HEADER_WORDS];
-		struct nfs_read_args d;
+		n_long	d[NFS_V3MAXFHSIZE / 4 + 4];
 	} sdata;
-	struct {
-		n_long	h[RPC_HEADER_WORDS];
-		struct nfs_read_repl d;
-	} rdata;
-	size_t cc;
-	long x;
-	int hlen, rlen;
-
-	args = &sdata.d;
-	repl = &rdata.d;
+	n_long *p, *rdata;
+	ssize_t cc;
+	int eof;
 
-	bcopy(d->fh, args->fh, NFS_FHSIZE);
-	args->off = htonl((n_long)off);
 	if (len > nfs_read_size)
 		len = nfs_read_size;
-	args->len = htonl((n_long)len);
-	args->xxx = htonl((n_long)0);
-	hlen = offsetof(struct nfs_read_repl, data[0]);
+	if ((p = nfs_mkread(d, sdata.d, off, len)) == NULL)
+		return (-1);
 
-	cc = rpc_call(d->iodesc, NFS_PROG, NFS_VER2, NFSPROC_READ,
-	    args, sizeof(*args),
-	    repl, sizeof(*repl));
+	rdata = nfs_read_buf + RPC_HEADER_WORDS;
+	cc = rpc_call(d->iodesc, NFS_PROG, nfs_version,
+	    nfs_version == NFS_VER3 ? NFSPROCV3_READ : NFSPROC_READ,
+	    sdata.d, (char *)p - (char *)sdata.d,
+	    rdata, nfs_read_buflen - RPC_HEADER_WORDS * sizeof(n_long));
 	if (cc == -1) {
 		/* errno was already set by rpc_call */
 		return (-1);
 	}
-	if (cc < hlen) {
-		errno = EBADRPC;
-		return (-1);
-	}
-	if (repl->errno) {
-		errno = ntohl(repl->errno);
+	return (nfs_readreply(rdata, cc, addr, len, &eof));
+}
+
+/*
+ * One READ of a pipelined transfer.
+ */
+struct nfs_rdreq {
+	off_t	off;
+	size_t	len;
+	n_long	xid;		/* 0 if the slot is free */
+	int	tries;		/* times sent */
+	u_int	sent;		/* getmsecs() when last sent */
+	u_int	rto;		/* current retransmit timeout, ms */
+};
+
+static ssize_t
+nfs_sendread(struct nfs_iodesc *d, struct nfs_rdreq *r)
+{
+	struct {
+		n_long	h[RPC_HEADER_WORDS];
+		n_long	d[NFS_V3MAXFHSIZE / 4 + 4];
+	} sdata;
+	n_long *p;
+
+	if ((p = nfs_mkread(d, sdata.d, r->off, r->len)) == NULL)
 		return (-1);
+	r->tries++;
+	r->sent = getmsecs();
+	net_sends++;
+	return (rpc_send(d->iodesc, NFS_PROG, nfs_version,
+	    nfs_version == NFS_VER3 ? NFSPROCV3_READ : NFSPROC_READ,
+	    r->xid, sdata.d, (char *)p - (char *)sdata.d));
+}
+
+/*
+ * Start (r) over as a new request with its own xid.
+ */
+static ssize_t
+nfs_newread(struct nfs_iodesc *d, struct nfs_rdreq *r)
+{
+	r->xid = rpc_newxid();
+	r->tries = 0;
+	r->rto = rtt_rto(d->iodesc);
+	return (nfs_sendread(d, r));
+}
+
+/*
+ * Read size bytes at fp->off keeping up to nfs_read_pipe READs in
+ * flight.  Replies are matched to their request by xid and copied to
+ * their place in buf in whatever order they come.  Each request has its
+ * own retransmit timer, started from the round trip estimate for the
+ * socket and backing off like sendrecv(); replies to requests sent
+ * only once update the estimate.  Returns zero or an error number, and
+ * the bytes read in *nread.
+ */
+static int
+nfs_readpipe(struct nfs_iodesc *fp, char *buf, size_t size, size_t *nread)
+{
+	struct nfs_rdreq req[NFS_READ_MAXPIPE], *r;
+	n_long *rdata, xid;
+	off_t start, next, eofoff;
+	ssize_t cc;
+	u_int now, wait, elapsed;
+	int i, busy, eof;
+
+	rdata = nfs_read_buf + RPC_HEADER_WORDS;
+	start = next = fp->off;
+	eofoff = start + size;
+	bzero(req, sizeof(req));
+
+	for (;;) {
+		/* Keep the pipe full. */
+		busy = 0;
+		for (i = 0, r = req; i < nfs_read_pipe; i++, r++) {
+			if (r->xid == 0 && next < eofoff) {
+				r->off = next;
+				r->len = eofoff - next;
+				if (r->len > nfs_read_size)
+					r->len = nfs_read_size;
+				next += r->len;
+				if (nfs_newread(fp, r) == -1)
+					return (errno);
+			}
+			if (r->xid != 0)
+				busy++;
+		}
+		if (busy == 0)
+			break;
+
+		/* Wait no longer than the first timer to run out. */
+		now = getmsecs();
+		wait = MAXTMO * 1000;
+		for (i = 0, r = req; i < nfs_read_pipe; i++, r++) {
+			if (r->xid == 0)
+				continue;
+			elapsed = now - r->sent;
+			if (elapsed >= r->rto)
+				wait = 0;
+			else if (r->rto - elapsed < wait)
+				wait = r->rto - elapsed;
+		}
+
+		xid = 0;
+		cc = rpc_recv(fp->iodesc, rdata,
+		    nfs_read_buflen - RPC_HEADER_WORDS * sizeof(n_long),
+		    wait, &xid);
+		if (cc == -1 && errno != 0)
+			return (errno);
+
+		/* Resend whatever has been waiting too long. */
+		now = getmsecs();
+		for (i = 0, r = req; i < nfs_read_pipe; i++, r++) {
+			if (r->xid == 0 || r->xid == xid ||
+			    now - r->sent < r->rto)
+				continue;
+			if (r->rto >= MAXTMO * 1000) {
+				net_timeouts++;
+				return (ETIMEDOUT);
+			}
+			net_retransmits++;
+			r->rto <<= 1;
+			if (r->rto > MAXTMO * 1000)
+				r->rto = MAXTMO * 1000;
+			twiddle();
+			if (nfs_sendread(fp, r) == -1)
+				return (errno);
+		}
+		if (cc == -1)
+			continue;
+
+		for (i = 0, r = req; i < nfs_read_pipe; i++, r++) {
+			if (r->xid != 0 && r->xid == xid)
+				break;
+		}
+		if (i == nfs_read_pipe)
+			continue;		/* late duplicate */
+
+		/* Karn: only a request sent once gives a clean sample. */
+		net_replies++;
+		if (r->tries == 1)
+			rtt_update(fp->iodesc, now - r->sent);
+
+		cc = nfs_readreply(rdata, cc, buf + (r->off - start), r->len,
+		    &eof);
+		if (cc == -1)
+			return (errno);
+		r->xid = 0;
+		if (cc < r->len) {
+			if (eof) {
+				if (r->off + cc < eofoff)
+					eofoff = r->off + cc;
+			} else {
+				/* Server gave us less, ask for the rest. */
+				r->off += cc;
+				r->len -= cc;
+				if (nfs_newread(fp, r) == -1)
+					return (errno);
+			}
+		}
 	}
-	rlen = cc - hlen;
-	x = ntohl(repl->count);
-	if (rlen < x) {
-		printf("nfsread: short packet, %d < %ld\n", rlen, x);
-		errno = EBADRPC;
-		return(-1);
-	}
-	bcopy(repl->data, addr, x);
-	return (x);
+
+	*nread = eofoff - start;
+	return (0);
 }
 
 /*
@@ -393,13 +810,13 @@ nfs_open(const char *upath, struct open_file *f)
 {
 	struct iodesc *desc;
 	struct nfs_iodesc *currfd;
-	char buf[2 * NFS_FHSIZE + 3];
+	char buf[2 * NFS_V3MAXFHSIZE + 3];
 	u_char *fh;
 	char *cp;
 	int i;
 #ifndef NFS_NOSYMLINK
 	struct nfs_iodesc *newfd;
-	struct nfsv2_fattrs *fa;
+	struct nfs_attr *fa;
 	char *ncp;
 	int c;
 	char namebuf[NFS_MAXPATHLEN + 1];
@@ -436,26 +853,29 @@ nfs_open(const char *upath, struct open_file *f)
 	/* Bind to a reserved port. */
 	desc->myport = htons(rpc_newport());
 	desc->destip = rootip;
-	if ((error = nfs_getrootfh(desc, rootpath, nfs_root_node.fh)))
+	if ((error = nfs_getrootfh(desc, rootpath, nfs_root_node.fh,
+	    &nfs_root_node.fhsize)))
 		return (error);
 	nfs_root_node.iodesc = desc;
 
 	fh = &nfs_root_node.fh[0];
 	buf[0] = 'X';
 	cp = &buf[1];
-	for (i = 0; i < NFS_FHSIZE; i++, cp += 2)
+	for (i = 0; i < nfs_root_node.fhsize; i++, cp += 2)
 		sprintf(cp, "%02x", fh[i]);
 	sprintf(cp, "X");
 	setenv("boot.nfsroot.server", inet_ntoa(rootip), 1);
 	setenv("boot.nfsroot.path", rootpath, 1);
 	setenv("boot.nfsroot.nfshandle", buf, 1);
+	sprintf(buf, "%d", nfs_root_node.fhsize);
+	setenv("boot.nfsroot.nfshandlelen", buf, 1);
 
 #ifndef NFS_NOSYMLINK
 	/* Fake up attributes for the root dir. */
 	fa = &nfs_root_node.fa;
-	fa->fa_type  = htonl(NFDIR);
-	fa->fa_mode  = htonl(0755);
-	fa->fa_nlink = htonl(2);
+	fa->type  = NFDIR;
+	fa->mode  = 0755;
+	fa->nlink = 2;
 
 	currfd = &nfs_root_node;
 	newfd = NULL;
@@ -477,7 +897,7 @@ nfs_open(const char *upath, struct open_file *f)
 		/*
 		 * Check that current node is a directory.
 		 */
-		if (currfd->fa.fa_type != htonl(NFDIR)) {
+		if (currfd->fa.type != NFDIR) {
 			error = ENOTDIR;
 			goto out;
 		}
@@ -513,7 +933,7 @@ nfs_open(const char *upath, struct open_file *f)
 		/*
 		 * Check for symbolic link
 		 */
-		if (newfd->fa.fa_type == htonl(NFLNK)) {
+		if (newfd->fa.type == NFLNK) {
 			int link_len, len;
 
 			error = nfs_readlink(newfd, linkbuf);
@@ -616,13 +1036,24 @@ nfs_read(struct open_file *f, void *buf, size_t size, size_t *resid)
 {
 	struct nfs_iodesc *fp = (struct nfs_iodesc *)f->f_fsdata;
 	ssize_t cc;
+	size_t n;
 	char *addr = buf;
+	int error;
 
 #ifdef NFS_DEBUG
 	if (debug)
 		printf("nfs_read: size=%lu off=%d\n", (u_long)size,
 		       (int)fp->off);
 #endif
+	if (nfs_read_pipe > 1 && size > nfs_read_size) {
+		twiddle();
+		error = nfs_readpipe(fp, addr, size, &n);
+		if (error)
+			return (error);
+		fp->off += n;
+		size -= n;
+		goto ret;
+	}
 	while ((int)size > 0) {
 		twiddle();
 		cc = nfs_readdata(fp, fp->off, addr, size);
@@ -669,7 +1100,7 @@ off_t
 nfs_seek(struct open_file *f, off_t offset, int where)
 {
 	struct nfs_iodesc *d = (struct nfs_iodesc *)f->f_fsdata;
-	n_long size = ntohl(d->fa.fa_size);
+	off_t size = d->fa.size;
 
 	switch (where) {
 	case SEEK_SET:
@@ -699,51 +1130,158 @@ nfs_stat(struct open_file *f, struct stat *sb)
 	struct nfs_iodesc *fp = (struct nfs_iodesc *)f->f_fsdata;
 	n_long ftype, mode;
 
-	ftype = ntohl(fp->fa.fa_type);
-	mode  = ntohl(fp->fa.fa_mode);
+	ftype = fp->fa.type;
+	mode  = fp->fa.mode;
 	mode |= nfs_stat_types[ftype & 7];
 
 	sb->st_mode  = mode;
-	sb->st_nlink = ntohl(fp->fa.fa_nlink);
-	sb->st_uid   = ntohl(fp->fa.fa_uid);
-	sb->st_gid   = ntohl(fp->fa.fa_gid);
-	sb->st_size  = ntohl(fp->fa.fa_size);
+	sb->st_nlink = fp->fa.nlink;
+	sb->st_uid   = fp->fa.uid;
+	sb->st_gid   = fp->fa.gid;
+	sb->st_size  = fp->fa.size;
 
 	return (0);
 }
 
+/* NFNON=0, NFREG=1, NFDIR=2, NFBLK=3, NFCHR=4, NFLNK=5 */
+static int nfs_dirent_types[8] = {
+	DT_UNKNOWN, DT_REG, DT_DIR, DT_BLK, DT_CHR, DT_LNK,
+	DT_UNKNOWN, DT_UNKNOWN };
+
+/*
+ * NFSv3 directories are read with READDIRPLUS, which hands us the
+ * attributes of each entry along with its name so d_type comes for free.
+ */
+static int
+nfs_readdirplus(struct nfs_iodesc *fp, struct dirent *d)
+{
+	static struct {
+		n_long	h[RPC_HEADER_WORDS];
+		n_long	d[NFS_READDIRSIZE / 4 + 4];
+	} rdata;
+	static struct nfs_xdr x;		/* x_p is NULL when drained */
+	static u_int64_t cookie;
+	static u_char verf[NFSX_V3COOKIEVERF];
+	static int eof;
+	struct {
+		n_long	h[RPC_HEADER_WORDS];
+		n_long	d[NFS_V3MAXFHSIZE / 4 + 7];
+	} sdata;
+	struct nfs_attr fa;
+	n_long *p, status, namlen;
+	void *name, *v;
+	int hasattr;
+	ssize_t cc;
+
+	for (;;) {
+		if (x.x_p == NULL) {
+			if (eof)
+				goto done;
+			p = nfs_put_fh(fp, sdata.d);
+			*p++ = htonl(cookie >> 32);
+			*p++ = htonl((n_long)cookie);
+			bcopy(verf, p, NFSX_V3COOKIEVERF);
+			p += NFSX_V3COOKIEVERF / 4;
+			*p++ = htonl(NFS_READDIRSIZE);	/* dircount */
+			*p++ = htonl(NFS_READDIRSIZE);	/* maxcount */
+
+			cc = rpc_call(fp->iodesc, NFS_PROG, NFS_VER3,
+			    NFSPROCV3_READDIRPLUS,
+			    sdata.d, (char *)p - (char *)sdata.d,
+			    rdata.d, sizeof(rdata.d));
+			if (cc == -1) {
+				status = errno;
+				goto fail;
+			}
+			xdr_init(&x, rdata.d, cc);
+			status = xdr_get(&x);
+			nfs_xdr_postop_attr(&x, NULL);
+			if (x.x_error) {
+				status = EIO;
+				goto fail;
+			}
+			if (status)
+				goto fail;
+			if ((v = xdr_opaque(&x, NFSX_V3COOKIEVERF)) != NULL)
+				bcopy(v, verf, NFSX_V3COOKIEVERF);
+		}
+
+		if (xdr_get(&x) == 0) {
+			/* end of this batch, maybe of the directory */
+			eof = xdr_get(&x);
+			if (x.x_error) {
+				status = EIO;
+				goto fail;
+			}
+			x.x_p = NULL;
+			continue;
+		}
+
+		xdr_get64(&x);				/* fileid */
+		namlen = xdr_get(&x);
+		if (namlen > NFS_MAXNAMLEN) {
+			status = EIO;
+			goto fail;
+		}
+		name = xdr_opaque(&x, namlen);
+		cookie = xdr_get64(&x);
+		hasattr = nfs_xdr_postop_attr(&x, &fa);
+		if (xdr_get(&x))			/* name_handle */
+			xdr_opaque(&x, xdr_get(&x));
+		if (x.x_error) {
+			status = EIO;
+			goto fail;
+		}
+
+		d->d_namlen = namlen;
+		bcopy(name, d->d_name, namlen);
+		d->d_name[namlen] = '\0';
+		d->d_type = hasattr ? nfs_dirent_types[fa.type & 7] : DT_UNKNOWN;
+		return (0);
+	}
+
+done:
+	status = ENOENT;
+fail:
+	x.x_p = NULL;
+	cookie = 0;
+	bzero(verf, sizeof(verf));
+	eof = 0;
+	return (status);
+}
+
 static int
 nfs_readdir(struct open_file *f, struct dirent *d)
 {
 	struct nfs_iodesc *fp = (struct nfs_iodesc *)f->f_fsdata;
-	struct nfs_readdir_args *args;
 	struct nfs_readdir_data *rd;
 	struct nfs_readdir_off  *roff = NULL;
 	static char *buf;
 	static n_long cookie = 0;
 	size_t cc;
 	n_long eof;
+	n_long *p;
 
 	struct {
 		n_long h[RPC_HEADER_WORDS];
-		struct nfs_readdir_args d;
+		n_long d[NFS_FHSIZE / 4 + 2];
 	} sdata;
 	static struct {
 		n_long h[RPC_HEADER_WORDS];
 		u_char d[NFS_READDIRSIZE];
 	} rdata;
 
+	if (nfs_version == NFS_VER3)
+		return (nfs_readdirplus(fp, d));
+
 	if (cookie == 0) {
 	refill:
-		args = &sdata.d;
-		bzero(args, sizeof(*args));
-
-		bcopy(fp->fh, args->fh, NFS_FHSIZE);
-		args->cookie = htonl(cookie);
-		args->count  = htonl(NFS_READDIRSIZE);
+		p = nfs_put_fh(fp, sdata.d);
+		*p++ = htonl(cookie);
+		*p++ = htonl(NFS_READDIRSIZE);
 
 		cc = rpc_call(fp->iodesc, NFS_PROG, NFS_VER2, NFSPROC_READDIR,
-			      args, sizeof(*args),
+			      sdata.d, (char *)p - (char *)sdata.d,
 			      rdata.d, sizeof(rdata.d));
 		buf  = rdata.d;
 		roff = (struct nfs_readdir_off *)buf;
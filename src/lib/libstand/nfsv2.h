@@ -110,6 +110,20 @@
 #define	NFS_NPROCS		18
 
 
+/*
+ * NFS version 3, "NFS Version 3 Protocol Specification" RFC1813.
+ * Only what the boot code uses.
+ */
+#define	NFS_VER3		3
+#define	NFS_V3MAXFHSIZE		64
+#define	NFSX_V3FATTR		84
+#define	NFSX_V3COOKIEVERF	8
+
+#define	NFSPROCV3_LOOKUP	3
+#define	NFSPROCV3_READLINK	5
+#define	NFSPROCV3_READ		6
+#define	NFSPROCV3_READDIRPLUS	17
+
 /* File types */
 typedef enum {
 	NFNON=0,
@@ -76,10 +76,22 @@ o_gethandle(void)
     return(-1);
 }
 
+/*
+ * Set up the readahead buffer.  A file system may suggest its block size
+ * in f_rasize from fo_open, otherwise start small and let read() grow it.
+ */
 static void
 o_rainit(struct open_file *f)
 {
-    f->f_rabuf = malloc(SOPEN_RASIZE);
+    if (f->f_rasize < SOPEN_RASIZE)
+	f->f_rasize = SOPEN_RASIZE;
+    if (f->f_rasize > SOPEN_RAMAX)
+	f->f_rasize = SOPEN_RAMAX;
+    f->f_rabuf = malloc(f->f_rasize);
+    if (f->f_rabuf == NULL && f->f_rasize > SOPEN_RASIZE) {
+	f->f_rasize = SOPEN_RASIZE;
+	f->f_rabuf = malloc(f->f_rasize);
+    }
     f->f_ralen = 0;
     f->f_raoffset = 0;
 }
@@ -88,6 +100,8 @@ int
 open(const char *fname, int mode)
 {
     struct open_file	*f;
+    struct fs_ops	*fs;
+    struct fs_mount	*m;
     int			fd, i, error, besterror;
     const char		*file;
 
@@ -103,6 +117,9 @@ open(const char *fname, int mode)
     f->f_offset = 0;
     f->f_devdata = NULL;
     f->f_fsdata = NULL;
+    f->f_mntdata = NULL;
+    f->f_mount = NULL;
+    f->f_rasize = 0;
     file = NULL;
     error = devopen(f, fname, &file);
     if (error || f->f_dev == NULL)
@@ -115,12 +132,43 @@ open(const char *fname, int mode)
 	return (fd);
     }
 
-    /* pass file name to the different filesystem open routines */
+    /* a device we have seen before goes straight to its file system */
     besterror = ENOENT;
+    if ((m = mount_lookup(f)) != NULL) {
+	mount_attach(f, m);
+	error = (m->m_ops->fo_open)(file, f);
+	if (error == 0) {
+	    f->f_ops = m->m_ops;
+	    o_rainit(f);
+	    return (fd);
+	}
+	mount_detach(f);
+	if (error != EINVAL)
+	    besterror = error;
+    }
+
+    /* pass file name to the different filesystem open routines */
     for (i = 0; file_system[i] != NULL; i++) {
-	error = ((*file_system[i]).fo_open)(file, f);
+	fs = file_system[i];
+	/* only stacked file systems are left to try on a known device */
+	if (m != NULL && fs->fo_unmount != NULL)
+	    continue;
+	f->f_mntdata = NULL;
+	error = (fs->fo_open)(file, f);
+	/* keep the device state even if the file wasn't there */
+	if (f->f_mntdata != NULL && fs->fo_unmount != NULL) {
+	    if ((m = mount_insert(f, fs)) == NULL) {
+		if (error == 0)
+		    (fs->fo_close)(f);
+		(fs->fo_unmount)(f->f_mntdata);
+		f->f_mntdata = NULL;
+		error = ENOMEM;
+	    } else if (error != 0) {
+		mount_detach(f);
+	    }
+	}
 	if (error == 0) {
-	    f->f_ops = file_system[i];
+	    f->f_ops = fs;
 	    o_rainit(f);
 	    return (fd);
 	}
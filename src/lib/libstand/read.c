@@ -66,6 +66,24 @@
 
 int no_io_error;
 
+/*
+ * Double the readahead buffer, keeping the old one if we are short of
+ * memory.  The buffer is empty when this is called.
+ */
+static void
+ragrow(struct open_file *f)
+{
+    size_t	size;
+    char	*buf;
+
+    size = imin(f->f_rasize * 2, SOPEN_RAMAX);
+    if ((buf = malloc(size)) == NULL)
+	return;
+    free(f->f_rabuf);
+    f->f_rabuf = buf;
+    f->f_rasize = size;
+}
+
 ssize_t
 read(int fd, void *dest, size_t bcount)
 {
@@ -108,18 +126,22 @@ read(int fd, void *dest, size_t bcount)
 	}
 
 	/* will filling the readahead buffer again not help? */
-	if (resid >= SOPEN_RASIZE) {
+	if (resid >= f->f_rasize) {
 	    /* bypass the rest of the request and leave the buffer empty */
 	    if ((errno = (f->f_ops->fo_read)(f, dest, resid, &cresid)))
 		return (-1);
 	    return(bcount - cresid);
 	}
 
+	/* the last buffer was drained by a sequential reader, read further */
+	if (f->f_raoffset != 0 && f->f_rasize < SOPEN_RAMAX)
+	    ragrow(f);
+
 	/* fetch more data */
-	if ((errno = (f->f_ops->fo_read)(f, f->f_rabuf, SOPEN_RASIZE, &cresid)))
+	if ((errno = (f->f_ops->fo_read)(f, f->f_rabuf, f->f_rasize, &cresid)))
 	    return (-1);
 	f->f_raoffset = 0;
-	f->f_ralen = SOPEN_RASIZE - cresid;
+	f->f_ralen = f->f_rasize - cresid;
 	/* no more data, return what we had */
 	if (f->f_ralen == 0)
 	    return(bcount - resid);
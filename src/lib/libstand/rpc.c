@@ -109,40 +109,41 @@ rpc_newport(void)
 }
 
 /*
- * Make a rpc call; return length of answer
- * Note: Caller must leave room for headers.
+ * Point (d) at the server port for prog/vers.
  */
-ssize_t
-rpc_call(struct iodesc *d, n_long prog, n_long vers, n_long proc, void *sdata,
-	 size_t slen, void *rdata, size_t rlen)
+static int
+rpc_setport(struct iodesc *d, n_long prog, n_long vers)
 {
-	ssize_t cc;
-	struct auth_info *auth;
-	struct rpc_call *call;
-	struct rpc_reply *reply;
-	char *send_head, *send_tail;
-	char *recv_head, *recv_tail;
-	n_long x;
 	int port;	/* host order */
 
-#ifdef RPC_DEBUG
-	if (debug)
-		printf("rpc_call: prog=0x%x vers=%d proc=%d\n",
-		    prog, vers, proc);
-#endif
-
 	port = rpc_getport(d, prog, vers);
 	if (port == -1)
 		return (-1);
+	if (port == 0) {
+		/* Not registered, eg. a protocol version the server lacks. */
+		errno = EPROGUNAVAIL;
+		return (-1);
+	}
 
 	d->destport = htons(port);
+	return (0);
+}
+
+/*
+ * Prepend authorization stuff and headers to sdata.
+ * Returns the start of the packet.
+ */
+static char *
+rpc_mkcall(n_long prog, n_long vers, n_long proc, n_long xid, void *sdata)
+{
+	struct auth_info *auth;
+	struct rpc_call *call;
+	char *send_head;
 
 	/*
-	 * Prepend authorization stuff and headers.
 	 * Note, must prepend things in reverse order.
 	 */
 	send_head = sdata;
-	send_tail = (char *)sdata + slen;
 
 	/* Auth verifier is always auth_null */
 	send_head -= sizeof(*auth);
@@ -169,41 +170,33 @@ rpc_call(struct iodesc *d, n_long prog, n_long vers, n_long proc, void *sdata,
 	/* RPC call structure. */
 	send_head -= sizeof(*call);
 	call = (struct rpc_call *)send_head;
-	rpc_xid++;
-	call->rp_xid       = htonl(rpc_xid);
+	call->rp_xid       = htonl(xid);
 	call->rp_direction = htonl(RPC_CALL);
 	call->rp_rpcvers   = htonl(RPC_VER2);
 	call->rp_prog = htonl(prog);
 	call->rp_vers = htonl(vers);
 	call->rp_proc = htonl(proc);
 
-	/* Make room for the rpc_reply header. */
-	recv_head = rdata;
-	recv_tail = (char *)rdata + rlen;
-	recv_head -= sizeof(*reply);
-
-	cc = sendrecv(d,
-	    sendudp, send_head, send_tail - send_head,
-	    recvrpc, recv_head, recv_tail - recv_head);
+	return (send_head);
+}
 
-#ifdef RPC_DEBUG
-	if (debug)
-		printf("callrpc: cc=%ld rlen=%lu\n", (long)cc, (u_long)rlen);
-#endif
-	if (cc == -1)
-		return (-1);
+/*
+ * Check the RPC reply status of the cc bytes at recv_head.
+ * The xid, dir, astatus were already checked.
+ * Returns the length of the answer following the header.
+ */
+static ssize_t
+rpc_chkreply(char *recv_head, ssize_t cc)
+{
+	struct auth_info *auth;
+	struct rpc_reply *reply;
+	n_long x;
 
 	if (cc <= sizeof(*reply)) {
 		errno = EBADRPC;
 		return (-1);
 	}
 
-	recv_tail = recv_head + cc;
-
-	/*
-	 * Check the RPC reply status.
-	 * The xid, dir, astatus were already checked.
-	 */
 	reply = (struct rpc_reply *)recv_head;
 	auth = &reply->rp_u.rpu_rok.rok_auth;
 	x = ntohl(auth->authlen);
@@ -216,14 +209,133 @@ rpc_call(struct iodesc *d, n_long prog, n_long vers, n_long proc, void *sdata,
 		return(-1);
 	}
 	x = ntohl(reply->rp_u.rpu_rok.rok_status);
+	if (x == RPC_PROGMISMATCH) {
+		errno = EPROGMISMATCH;
+		return(-1);
+	}
 	if (x != 0) {
 		printf("callrpc: error = %ld\n", (long)x);
 		errno = EBADRPC;
 		return(-1);
 	}
-	recv_head += sizeof(*reply);
 
-	return (ssize_t)(recv_tail - recv_head);
+	return (cc - sizeof(*reply));
+}
+
+/*
+ * Make a rpc call; return length of answer
+ * Note: Caller must leave room for headers.
+ */
+ssize_t
+rpc_call(struct iodesc *d, n_long prog, n_long vers, n_long proc, void *sdata,
+	 size_t slen, void *rdata, size_t rlen)
+{
+	ssize_t cc;
+	struct rpc_reply *reply;
+	char *send_head, *send_tail;
+	char *recv_head, *recv_tail;
+
+#ifdef RPC_DEBUG
+	if (debug)
+		printf("rpc_call: prog=0x%x vers=%d proc=%d\n",
+		    prog, vers, proc);
+#endif
+
+	if (rpc_setport(d, prog, vers) == -1)
+		return (-1);
+
+	rpc_xid++;
+	send_head = rpc_mkcall(prog, vers, proc, rpc_xid, sdata);
+	send_tail = (char *)sdata + slen;
+
+	/* Make room for the rpc_reply header. */
+	recv_head = rdata;
+	recv_tail = (char *)rdata + rlen;
+	recv_head -= sizeof(*reply);
+
+	cc = sendrecv(d,
+	    sendudp, send_head, send_tail - send_head,
+	    recvrpc, recv_head, recv_tail - recv_head);
+
+#ifdef RPC_DEBUG
+	if (debug)
+		printf("callrpc: cc=%ld rlen=%lu\n", (long)cc, (u_long)rlen);
+#endif
+	if (cc == -1)
+		return (-1);
+
+	return (rpc_chkreply(recv_head, cc));
+}
+
+/*
+ * For callers keeping several calls in flight: a fresh xid to tag a
+ * call with, which is kept when the call is retransmitted.
+ */
+n_long
+rpc_newxid(void)
+{
+	return (++rpc_xid);
+}
+
+/*
+ * Send a call without waiting for the answer.
+ * Note: Caller must leave room for headers.
+ */
+ssize_t
+rpc_send(struct iodesc *d, n_long prog, n_long vers, n_long proc, n_long xid,
+	 void *sdata, size_t slen)
+{
+	char *send_head, *send_tail;
+
+	if (rpc_setport(d, prog, vers) == -1)
+		return (-1);
+
+	send_head = rpc_mkcall(prog, vers, proc, xid, sdata);
+	send_tail = (char *)sdata + slen;
+	return (sendudp(d, send_head, send_tail - send_head));
+}
+
+/*
+ * Wait up to tmo milliseconds for the reply to any call made with
+ * rpc_send(), polling at least once.  Returns the length of the answer
+ * and its xid in *xidp, or -1 with errno 0 if nothing came.
+ */
+ssize_t
+rpc_recv(struct iodesc *d, void *rdata, size_t rlen, u_int tmo,
+	 n_long *xidp)
+{
+	struct rpc_reply *reply;
+	char *recv_head;
+	u_int t, elapsed;
+	ssize_t n;
+	n_long x;
+
+	recv_head = (char *)rdata - sizeof(*reply);
+	reply = (struct rpc_reply *)recv_head;
+
+	t = getmsecs();
+	elapsed = 0;
+	do {
+		errno = 0;
+		n = readudp(d, recv_head, rlen + sizeof(*reply),
+		    (tmo - elapsed) / 1000);
+		if (n <= (4 * 4))
+			continue;
+		if (ntohl(reply->rp_direction) != RPC_REPLY)
+			continue;
+		x = ntohl(reply->rp_astatus);
+		if (x != RPC_MSGACCEPTED) {
+			errno = ntohl(reply->rp_u.rpu_errno);
+			printf("rpc_recv: reject, astat=%d, errno=%d\n",
+			    x, errno);
+			return (-1);
+		}
+		*xidp = ntohl(reply->rp_xid);
+		return (rpc_chkreply(recv_head, n));
+	} while ((elapsed = getmsecs() - t) < tmo);
+
+	errno = 0;
+	return (-1);
 }
 
 /*
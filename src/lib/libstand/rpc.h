@@ -51,6 +51,10 @@ void	rpc_fromaddr(void *, struct in_addr *, u_short *);
 int	rpc_pmap_getcache(struct in_addr, u_int, u_int);
 void	rpc_pmap_putcache(struct in_addr, u_int, u_int, int);
 int	rpc_newport(void);
+n_long	rpc_newxid(void);
+ssize_t	rpc_send(struct iodesc *, n_long, n_long, n_long, n_long,
+		 void *, size_t);
+ssize_t	rpc_recv(struct iodesc *, void *, size_t, u_int, n_long *);
 
 /*
  * How much space to leave in front of RPC requests.
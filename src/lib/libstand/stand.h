@@ -90,6 +90,7 @@
 #define	ESALAST	(ELAST+8)	/* */
 
 struct open_file;
+struct fs_mount;
 
 /*
  * This structure is used to define file system operations in a file system
@@ -110,6 +111,20 @@ struct fs_ops {
     off_t	(*fo_seek)(struct open_file *, off_t, int);
     int		(*fo_stat)(struct open_file *, struct stat *);
     int		(*fo_readdir)(struct open_file *, struct dirent *);
+    void	(*fo_unmount)(void *);	/* release f_mntdata, see mount.c */
+};
+
+/*
+ * Per-device file system state kept across opens by the mount cache.
+ */
+struct fs_mount {
+    struct fs_mount	*m_next;
+    struct devsw	*m_dev;
+    char		*m_devname;	/* devformat() name, NULL if private */
+    struct fs_ops	*m_ops;
+    void		*m_data;	/* f_mntdata handed over by m_ops */
+    int			m_refs;		/* open files using m_data */
+    int			m_stale;	/* free on last detach */
 };
 
 /*
@@ -126,6 +141,12 @@ extern struct fs_ops dosfs_fsops;
 extern struct fs_ops ext2fs_fsops;
 extern struct fs_ops splitfs_fsops;
 
+/* hammer1.c */
+extern void	hammerstats(void);
+
+/* net.c */
+extern void	netstats(void);
+
 /* where values for lseek(2) */
 #define	SEEK_SET	0	/* set file offset to offset */
 #define	SEEK_CUR	1	/* set file offset to current plus offset */
@@ -162,9 +183,13 @@ struct open_file {
     void		*f_fsdata;	/* file system specific data */
     off_t		f_offset;	/* current file offset */
     char		*f_rabuf;	/* readahead buffer pointer */
+    size_t		f_rasize;	/* readahead buffer size, fo_open hint */
     size_t		f_ralen;	/* valid data in readahead buffer */
     off_t		f_raoffset;	/* consumer offset in readahead buffer */
-#define SOPEN_RASIZE	512
+#define SOPEN_RASIZE	512		/* initial readahead buffer size */
+#define SOPEN_RAMAX	(64 * 1024)	/* grown to on sequential access */
+    void		*f_mntdata;	/* per-device file system state */
+    struct fs_mount	*f_mount;	/* mount cache entry holding f_mntdata */
 };
 
 #define	SOPEN_MAX	8
@@ -175,6 +200,7 @@ extern struct open_file files[];
 #define	F_WRITE		0x0002	/* file opened for writing */
 #define	F_RAW		0x0004	/* raw device open - no file system */
 #define F_DEVDESC	0x0008	/* generic devdesc, else specific */
+#define	F_VOLATILE	0x0010	/* removable media, set by the device open */
 
 #define isascii(c)	(((c) & ~0x7F) == 0)
 
@@ -367,6 +393,13 @@ extern off_t	null_seek(struct open_file *, off_t, int);
 extern int	null_stat(struct open_file *, struct stat *);
 extern int	null_readdir(struct open_file *, struct dirent *);
 
+/* mount.c */
+extern struct fs_mount	*mount_lookup(struct open_file *);
+extern struct fs_mount	*mount_insert(struct open_file *, struct fs_ops *);
+extern void	mount_attach(struct open_file *, struct fs_mount *);
+extern void	mount_detach(struct open_file *);
+extern void	mount_flush(void);
+
 
 /*
  * Machine dependent functions and data, must be provided or stubbed by
@@ -378,6 +411,7 @@ extern void		putchar(int);
 extern int		devopen(struct open_file *, const char *, const char **);
 extern int		devclose(struct open_file *);
 extern void		devreplace(struct open_file *, void *devdata);
+extern char		*devformat(struct open_file *);
 extern void		panic(const char *, ...) __dead2 __printflike(1, 2);
 extern struct fs_ops	*file_system[];
 extern struct devsw	*devsw[];
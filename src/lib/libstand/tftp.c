@@ -82,7 +82,41 @@ extern struct in_addr servip;
 
 static int      tftpport = 2000;
 
-#define RSPACE 520		/* max data packet, rounded up */
+#ifndef OACK
+#define OACK	06		/* option acknowledgement, RFC 2347 */
+#endif
+
+/*
+ * Block size we ask for (RFC 2348).  The default fits an unfragmented
+ * packet on ethernet, tftp.blksize may raise it up to TFTP_MAX_BLKSIZE
+ * on jumbo frame capable networks, or as far as udp_maxdata allows.
+ */
+#define TFTP_REQUESTED_BLKSIZE	1428
+#define TFTP_MAX_BLKSIZE	8192
+
+/*
+ * Number of blocks the server may send per ACK (RFC 7440), tunable
+ * with tftp.windowsize.  1 is plain lock-step TFTP.
+ */
+#define TFTP_REQUESTED_WINDOWSIZE	8
+#define TFTP_MAX_WINDOWSIZE		64
+
+/*
+ * Received blocks are kept so backward seeks don't restart the
+ * transfer.  If the server told us the size and the file fits the
+ * budget, all of it is kept; load_elf reads the section headers at the
+ * end of a kernel and then goes back for the symbol table.  Otherwise a
+ * quarter of the cache holds the start of the file (ELF and program
+ * headers), the rest the most recent blocks, and a file of unknown size
+ * gets no more than TFTP_CACHE_RING.  tftp.cache_size sets the budget in
+ * bytes, 0 disables the cache.  Either way the budget is held to an
+ * eighth of the heap, which also has to carry bcache and whatever the
+ * file is being loaded for.
+ */
+#define TFTP_CACHE_SIZE		(4 * 1024 * 1024)
+#define TFTP_CACHE_RING		(64 * 1024)
+
+#define RSPACE (TFTP_MAX_BLKSIZE + 8)	/* max data packet, rounded up */
 
 struct tftp_handle {
 	struct iodesc  *iodesc;
@@ -90,6 +124,19 @@ struct tftp_handle {
 	int             islastblock;	/* flag */
 	int             validsize;
 	int             off;
+	int             blksize;	/* negotiated block size */
+	int             reqblksize;	/* block size to ask for */
+	int             windowsize;	/* negotiated blocks per ACK */
+	int             reqwindowsize;	/* window size to ask for */
+	int             lastack;	/* last block we acknowledged */
+	int             holdack;	/* within window, don't ACK yet */
+	int             nakblock;	/* already asked to resend from here */
+	off_t           tsize;		/* file size from server, or -1 */
+	int             cacheslots;	/* blocks in cache, 0 if none */
+	int             cachehead;	/* slots reserved for block 1.. */
+	int            *cacheblk;	/* block held by each slot, or 0 */
+	int            *cachelen;	/* valid bytes in each slot */
+	char           *cachedata;
 	char           *path;	/* saved for re-requests */
 	struct {
 		u_char header[HEADER_SIZE];
@@ -98,7 +145,10 @@ struct tftp_handle {
 	} __packed __aligned(4) lastdata;
 };
 
-static int tftperrors[8] = {
+/* transfer tftp_getnextblock() is waiting on, for the sendrecv() hooks */
+static struct tftp_handle *tftp_cur;
+
+static int tftperrors[9] = {
 	0,			/* ??? */
 	ENOENT,
 	EPERM,
@@ -106,9 +156,13 @@ static int tftperrors[8] = {
 	EINVAL,			/* ??? */
 	EINVAL,			/* ??? */
 	EEXIST,
-	EINVAL			/* ??? */
+	EINVAL,			/* ??? */
+	EOPNOTSUPP		/* option negotiation refused */
 };
 
+static int	tftp_getnextblock(struct tftp_handle *h);
+static ssize_t	tftp_sendack(struct tftp_handle *h);
+
 static ssize_t
 recvtftp(struct iodesc *d, void *pkt, size_t max_len, time_t tleft)
 {
@@ -131,7 +185,8 @@ recvtftp(struct iodesc *d, void *pkt, size_t max_len, time_t tleft)
 		while ((tmp_len = readudp(d, pkt, max_len, tleft)) > 0) {
 			len = tmp_len;
 			t = (struct tftphdr *)pkt;
-			if (ntohs(t->th_opcode) == DATA)
+			if (ntohs(t->th_opcode) == DATA ||
+			    ntohs(t->th_opcode) == OACK)
 				break;
 		}
 	} else {
@@ -146,10 +201,21 @@ recvtftp(struct iodesc *d, void *pkt, size_t max_len, time_t tleft)
 	case DATA: {
 		int got;
 
-		if (htons(t->th_block) != d->xid) {
+		if (ntohs(t->th_block) != (u_short)d->xid) {
+			struct tftp_handle *h = tftp_cur;
+
 			/*
-			 * Expected block?
+			 * Expected block?  A block further into the window
+			 * means we lost one; ACK what we have once so the
+			 * server restarts from there.  Duplicates are
+			 * dropped.
 			 */
+			if (h != NULL && h->windowsize > 1 &&
+			    (u_short)(ntohs(t->th_block) - d->xid) <
+			    h->windowsize && h->nakblock != h->currblock) {
+				h->nakblock = h->currblock;
+				tftp_sendack(h);
+			}
 			return (-1);
 		}
 		if (d->xid == 1) {
@@ -169,8 +235,24 @@ recvtftp(struct iodesc *d, void *pkt, size_t max_len, time_t tleft)
 		got = len - (t->th_data - (char *)t);
 		return got;
 	}
+	case OACK: {
+		struct udphdr *uh;
+		struct ip *ip;
+
+		/*
+		 * Options accepted, only valid as the answer to our
+		 * request.  The caller parses them out of th_stuff.
+		 */
+		if (d->xid != 1 || d->destport != htons(IPPORT_TFTP))
+			return (-1);
+		uh = (struct udphdr *) pkt - 1;
+		ip = (struct ip *)uh - 1;
+		d->destport = uh->uh_sport;
+		d->destip = ip->ip_src;
+		return (len - (t->th_stuff - (char *)t));
+	}
 	case ERROR:
-		if ((unsigned) ntohs(t->th_code) >= 8) {
+		if ((unsigned) ntohs(t->th_code) >= 9) {
 			printf("illegal tftp error %d\n", ntohs(t->th_code));
 			errno = EIO;
 		} else {
@@ -188,6 +270,144 @@ recvtftp(struct iodesc *d, void *pkt, size_t max_len, time_t tleft)
 	}
 }
 
+static int
+tftp_cache_slot(struct tftp_handle *h, int block)
+{
+	if (block <= h->cachehead)
+		return (block - 1);
+	return (h->cachehead +
+	    (block - h->cachehead - 1) % (h->cacheslots - h->cachehead));
+}
+
+/* remember the block in lastdata */
+static void
+tftp_cache_enter(struct tftp_handle *h)
+{
+	int slot;
+
+	if (h->cacheslots == 0 || h->currblock < 1)
+		return;
+	slot = tftp_cache_slot(h, h->currblock);
+	h->cacheblk[slot] = h->currblock;
+	h->cachelen[slot] = h->validsize;
+	bcopy(h->lastdata.t.th_data, h->cachedata + slot * h->blksize,
+	      h->validsize);
+}
+
+static char *
+tftp_cache_lookup(struct tftp_handle *h, int block, int *validsize)
+{
+	int slot;
+
+	if (h->cacheslots == 0)
+		return (NULL);
+	slot = tftp_cache_slot(h, block);
+	if (h->cacheblk[slot] != block)
+		return (NULL);
+	*validsize = h->cachelen[slot];
+	return (h->cachedata + slot * h->blksize);
+}
+
+/*
+ * Size the cache once the block size is settled.  If the allocation
+ * fails anyway, drop to the ring and then keep halving; runs without a
+ * cache if there is none to be had.
+ */
+static void
+tftp_cache_init(struct tftp_handle *h)
+{
+	char *cp;
+	long budget;
+	size_t heapsize;
+	int nslots, ringslots;
+
+	budget = TFTP_CACHE_SIZE;
+	if ((cp = getenv("tftp.cache_size")) != NULL)
+		budget = strtol(cp, NULL, 0);
+	(void)getheap(&heapsize);
+	if (budget > (long)(heapsize / 8))
+		budget = heapsize / 8;
+	nslots = budget / h->blksize;
+	ringslots = TFTP_CACHE_RING / h->blksize;
+	if (h->tsize >= 0 && h->tsize / h->blksize + 1 <= nslots)
+		nslots = h->tsize / h->blksize + 1;
+	else if (h->tsize < 0 && nslots > ringslots)
+		nslots = ringslots;
+
+	for (; nslots > 0;
+	    nslots = nslots > ringslots ? ringslots : nslots / 2) {
+		h->cachedata = malloc(nslots * h->blksize);
+		h->cacheblk = malloc(nslots * sizeof(int));
+		h->cachelen = malloc(nslots * sizeof(int));
+		if (h->cachedata != NULL && h->cacheblk != NULL &&
+		    h->cachelen != NULL)
+			break;
+		if (h->cachedata != NULL)
+			free(h->cachedata);
+		if (h->cacheblk != NULL)
+			free(h->cacheblk);
+		if (h->cachelen != NULL)
+			free(h->cachelen);
+	}
+	if (nslots <= 0) {
+		h->cacheslots = 0;
+		return;
+	}
+	bzero(h->cacheblk, nslots * sizeof(int));
+	h->cacheslots = nslots;
+	h->cachehead = nslots / 4;
+	tftp_cache_enter(h);
+}
+
+static void
+tftp_cache_free(struct tftp_handle *h)
+{
+	if (h->cacheslots == 0)
+		return;
+	free(h->cachedata);
+	free(h->cacheblk);
+	free(h->cachelen);
+	h->cacheslots = 0;
+}
+
+/*
+ * Pick the options we asked for out of an OACK.  Options the server
+ * left out keep their RFC 1350 defaults.
+ */
+static int
+tftp_parse_oack(struct tftp_handle *h, char *buf, size_t len)
+{
+	char *opt, *val, *end;
+	long n;
+
+	end = buf + len;
+	while (buf < end) {
+		opt = buf;
+		val = memchr(opt, '\0', end - opt);
+		if (val == NULL || ++val >= end)
+			return (EIO);
+		buf = memchr(val, '\0', end - val);
+		if (buf == NULL)
+			return (EIO);
+		buf++;
+
+		if (strcasecmp(opt, "blksize") == 0) {
+			n = strtol(val, NULL, 10);
+			if (n < 8 || n > h->reqblksize)
+				return (EIO);
+			h->blksize = n;
+		} else if (strcasecmp(opt, "tsize") == 0) {
+			h->tsize = strtol(val, NULL, 10);
+		} else if (strcasecmp(opt, "windowsize") == 0) {
+			n = strtol(val, NULL, 10);
+			if (n < 1 || n > h->reqwindowsize)
+				return (EIO);
+			h->windowsize = n;
+		}
+	}
+	return (0);
+}
+
 /* send request, expect first block (or error) */
 static int
 tftp_makereq(struct tftp_handle *h)
@@ -195,76 +415,167 @@ tftp_makereq(struct tftp_handle *h)
 	struct {
 		u_char header[HEADER_SIZE];
 		struct tftphdr  t;
-		u_char space[FNAME_SIZE + 6];
+		u_char space[FNAME_SIZE + 6 + 48];
 	} __packed __aligned(4) wbuf;
 	char           *wtail;
 	int             l;
+	int             withopts, oblksize, recache;
 	ssize_t         res;
 	struct tftphdr *t;
 
-	wbuf.t.th_opcode = htons((u_short) RRQ);
-	wtail = wbuf.t.th_stuff;
-	l = strlen(h->path);
-	bcopy(h->path, wtail, l + 1);
-	wtail += l + 1;
-	bcopy("octet", wtail, 6);
-	wtail += 6;
-
 	t = &h->lastdata.t;
+	oblksize = h->blksize;
 
-	/* h->iodesc->myport = htons(--tftpport); */
-	h->iodesc->myport = htons(tftpport + (getsecs() & 0x3ff));
-	h->iodesc->destport = htons(IPPORT_TFTP);
-	h->iodesc->xid = 1;	/* expected block */
+	/*
+	 * Ask for options first, and again without them if the server
+	 * errors out on a request it doesn't understand.
+	 */
+	for (withopts = 1; withopts >= 0; withopts--) {
+		wbuf.t.th_opcode = htons((u_short) RRQ);
+		wtail = wbuf.t.th_stuff;
+		l = strlen(h->path);
+		bcopy(h->path, wtail, l + 1);
+		wtail += l + 1;
+		bcopy("octet", wtail, 6);
+		wtail += 6;
+		if (withopts) {
+			if (h->reqblksize != SEGSIZE) {
+				bcopy("blksize", wtail, 8);
+				wtail += 8;
+				wtail += sprintf(wtail, "%d", h->reqblksize) + 1;
+			}
+			if (h->reqwindowsize > 1) {
+				bcopy("windowsize", wtail, 11);
+				wtail += 11;
+				wtail += sprintf(wtail, "%d", h->reqwindowsize) + 1;
+			}
+			bcopy("tsize\0000", wtail, 8);
+			wtail += 8;
+		}
 
-	res = sendrecv(h->iodesc, sendudp, &wbuf.t, wtail - (char *) &wbuf.t,
-		       recvtftp, t, sizeof(*t) + RSPACE);
+		/* h->iodesc->myport = htons(--tftpport); */
+		h->iodesc->myport = htons(tftpport + (getsecs() & 0x3ff));
+		h->iodesc->destport = htons(IPPORT_TFTP);
+		h->iodesc->xid = 1;	/* expected block */
+
+		h->blksize = SEGSIZE;
+		h->windowsize = 1;
+		h->tsize = -1;
+		res = sendrecv(h->iodesc, sendudp, &wbuf.t,
+			       wtail - (char *) &wbuf.t,
+			       recvtftp, t, sizeof(*t) + RSPACE);
+		if (res != -1)
+			break;
+		if (!withopts || errno == 0 || errno == ENOENT ||
+		    errno == EPERM || errno == ETIMEDOUT)
+			return (errno ? errno : EIO);
+	}
 
-	if (res == -1)
-		return (errno);
+	/*
+	 * Options accepted, acknowledge with block 0 to get block 1.
+	 */
+	if (ntohs(t->th_opcode) == OACK &&
+	    (l = tftp_parse_oack(h, t->th_stuff, res)) != 0)
+		return (l);
 
-	h->currblock = 1;
-	h->validsize = res;
-	h->islastblock = 0;
-	if (res < SEGSIZE)
-		h->islastblock = 1;	/* very short file */
+	/*
+	 * A restart may settle on another block size; the cache slots are
+	 * laid out by block size, so start the cache over.
+	 */
+	recache = h->cacheslots != 0 && h->blksize != oblksize;
+	if (recache)
+		tftp_cache_free(h);
+
+	if (ntohs(t->th_opcode) == OACK) {
+		h->currblock = 0;
+		h->lastack = -h->windowsize;	/* ACK 0 goes out now */
+		h->islastblock = 0;
+		if ((l = tftp_getnextblock(h)) != 0)
+			return (l);
+	} else {
+		h->currblock = 1;
+		h->lastack = 0;
+		h->validsize = res;
+		h->islastblock = 0;
+		if (res < h->blksize)
+			h->islastblock = 1;	/* very short file */
+		tftp_cache_enter(h);
+	}
+	if (recache)
+		tftp_cache_init(h);
 	return (0);
 }
 
-/* ack block, expect next */
-static int
-tftp_getnextblock(struct tftp_handle *h)
+/*
+ * Acknowledge everything up to h->currblock.  With a window this is
+ * also where the server restarts after a loss.
+ */
+static ssize_t
+tftp_sendack(struct tftp_handle *h)
 {
 	struct {
 		u_char header[HEADER_SIZE];
 		struct tftphdr t;
 	} __packed __aligned(4) wbuf;
 	char           *wtail;
-	int             res;
-	struct tftphdr *t;
 
-	/*
-	 * Ack previous block
-	 */
 	wbuf.t.th_opcode = htons((u_short) ACK);
 	wtail = (char *) &wbuf.t.th_block;
 	wbuf.t.th_block = htons((u_short) h->currblock);
 	wtail += 2;
 
+	h->lastack = h->currblock;
+	return (sendudp(h->iodesc, &wbuf.t, wtail - (char *) &wbuf.t));
+}
+
+/*
+ * Send routine for sendrecv().  Inside a window the server keeps
+ * sending on its own, so the first call only arms the timeout and
+ * returns 0, which keeps the gap between two data packets out of the
+ * round trip estimate.  If that runs out the ACK for the last block we
+ * hold gets things going again.
+ */
+static ssize_t
+tftp_ackproc(struct iodesc *d __unused, void *pkt __unused,
+    size_t len __unused)
+{
+	struct tftp_handle *h = tftp_cur;
+
+	if (h->holdack) {
+		h->holdack = 0;
+		return (0);
+	}
+	return (tftp_sendack(h));
+}
+
+/* ack block (or window), expect next */
+static int
+tftp_getnextblock(struct tftp_handle *h)
+{
+	int             res;
+	struct tftphdr *t;
+
 	t = &h->lastdata.t;
 
 	h->iodesc->xid = h->currblock + 1;	/* expected block */
+	h->holdack = (h->currblock - h->lastack < h->windowsize);
+	h->nakblock = -1;
 
-	res = sendrecv(h->iodesc, sendudp, &wbuf.t, wtail - (char *) &wbuf.t,
+	tftp_cur = h;
+	res = sendrecv(h->iodesc, tftp_ackproc, NULL, 0,
 		       recvtftp, t, sizeof(*t) + RSPACE);
+	tftp_cur = NULL;
 
 	if (res == -1)		/* 0 is OK! */
 		return (errno);
 
 	h->currblock++;
 	h->validsize = res;
-	if (res < SEGSIZE)
+	if (res < h->blksize) {
 		h->islastblock = 1;	/* EOF */
+		tftp_sendack(h);	/* let the server finish */
+	}
+	tftp_cache_enter(h);
 	return (0);
 }
 
@@ -273,6 +584,7 @@ tftp_open(const char *path, struct open_file *f)
 {
 	struct tftp_handle *tftpfile;
 	struct iodesc  *io;
+	char           *cp;
 	int             res;
 
 	if (strcmp(f->f_dev->dv_name, "net") != 0) {
@@ -296,6 +608,22 @@ tftp_open(const char *path, struct open_file *f)
 
 	io->destip = servip;
 	tftpfile->off = 0;
+	tftpfile->reqblksize = TFTP_REQUESTED_BLKSIZE;
+	if ((cp = getenv("tftp.blksize")) != NULL) {
+		res = strtol(cp, NULL, 0);
+		if (res >= SEGSIZE && res <= TFTP_MAX_BLKSIZE)
+			tftpfile->reqblksize = res;
+	}
+	/* DATA packets carry a 4 byte header on top of the block */
+	if (udp_maxdata != 0 && tftpfile->reqblksize > udp_maxdata - 4)
+		tftpfile->reqblksize = udp_maxdata - 4;
+	tftpfile->reqwindowsize = TFTP_REQUESTED_WINDOWSIZE;
+	if ((cp = getenv("tftp.windowsize")) != NULL) {
+		res = strtol(cp, NULL, 0);
+		if (res >= 1 && res <= TFTP_MAX_WINDOWSIZE)
+			tftpfile->reqwindowsize = res;
+	}
+	tftpfile->cacheslots = 0;
 	tftpfile->path = strdup(path);
 	if (tftpfile->path == NULL) {
 	    free(tftpfile);
@@ -309,7 +637,9 @@ tftp_open(const char *path, struct open_file *f)
 		free(tftpfile);
 		return (res);
 	}
+	tftp_cache_init(tftpfile);
 	f->f_fsdata = (void *) tftpfile;
+	f->f_rasize = tftpfile->blksize;
 	return (0);
 }
 
@@ -325,61 +655,74 @@ tftp_read(struct open_file *f, void *addr, size_t size, size_t *resid)
 	tftpfile = (struct tftp_handle *) f->f_fsdata;
 
 	while (size > 0) {
-		int needblock, count;
+		int needblock, count, validsize;
+		int offinblock, inbuffer;
+		char *data;
 
 		if (!(tc++ % 16))
 			twiddle();
 
-		needblock = tftpfile->off / SEGSIZE + 1;
+		needblock = tftpfile->off / tftpfile->blksize + 1;
 
-		if (tftpfile->currblock > needblock)	/* seek backwards */
-			tftp_makereq(tftpfile);	/* no error check, it worked
-						 * for open */
+		data = NULL;
+		if (tftpfile->currblock != needblock)
+			data = tftp_cache_lookup(tftpfile, needblock,
+			    &validsize);
+		if (data == NULL) {
+			/*
+			 * Seek backwards; no error check, it worked for open.
+			 * The block size may have changed on the way.
+			 */
+			if (tftpfile->currblock > needblock) {
+				tftp_makereq(tftpfile);
+				needblock = tftpfile->off /
+				    tftpfile->blksize + 1;
+			}
 
-		while (tftpfile->currblock < needblock) {
-			int res;
+			while (tftpfile->currblock < needblock) {
+				int res;
 
-			res = tftp_getnextblock(tftpfile);
-			if (res) {	/* no answer */
+				res = tftp_getnextblock(tftpfile);
+				if (res) {	/* no answer */
 #ifdef TFTP_DEBUG
-				printf("tftp: read error\n");
+					printf("tftp: read error\n");
 #endif
-				return (res);
+					return (res);
+				}
+				if (tftpfile->islastblock)
+					break;
 			}
-			if (tftpfile->islastblock)
-				break;
-		}
-
-		if (tftpfile->currblock == needblock) {
-			int offinblock, inbuffer;
-
-			offinblock = tftpfile->off % SEGSIZE;
 
-			inbuffer = tftpfile->validsize - offinblock;
-			if (inbuffer < 0) {
+			if (tftpfile->currblock != needblock) {
 #ifdef TFTP_DEBUG
-				printf("tftp: invalid offset %d\n",
-				    tftpfile->off);
+				printf("tftp: block %d not found\n",
+				    needblock);
 #endif
 				return (EINVAL);
 			}
-			count = (size < inbuffer ? size : inbuffer);
-			bcopy(tftpfile->lastdata.t.th_data + offinblock,
-			      addr, count);
+			data = tftpfile->lastdata.t.th_data;
+			validsize = tftpfile->validsize;
+		}
 
-			addr = (char *)addr + count;
-			tftpfile->off += count;
-			size -= count;
+		offinblock = tftpfile->off % tftpfile->blksize;
 
-			if ((tftpfile->islastblock) && (count == inbuffer))
-				break;	/* EOF */
-		} else {
+		inbuffer = validsize - offinblock;
+		if (inbuffer < 0) {
 #ifdef TFTP_DEBUG
-			printf("tftp: block %d not found\n", needblock);
+			printf("tftp: invalid offset %d\n",
+			    tftpfile->off);
 #endif
 			return (EINVAL);
 		}
+		count = (size < inbuffer ? size : inbuffer);
+		bcopy(data + offinblock, addr, count);
+
+		addr = (char *)addr + count;
+		tftpfile->off += count;
+		size -= count;
 
+		if (validsize < tftpfile->blksize && count == inbuffer)
+			break;	/* EOF */
 	}
 
 	if (resid)
@@ -396,6 +739,7 @@ tftp_close(struct open_file *f)
 	/* let it time out ... */
 	f->f_fsdata = NULL;
 	if (tftpfile) {
+		tftp_cache_free(tftpfile);
 		free(tftpfile->path);
 		free(tftpfile);
 		f->f_fsdata = NULL;
@@ -415,13 +759,16 @@ tftp_write(struct open_file *f __unused, void *start __unused, size_t size __unu
 }
 
 static int
-tftp_stat(struct open_file *f __unused, struct stat *sb)
+tftp_stat(struct open_file *f, struct stat *sb)
 {
+	struct tftp_handle *tftpfile;
+	tftpfile = (struct tftp_handle *) f->f_fsdata;
+
 	sb->st_mode = 0444 | S_IFREG;
 	sb->st_nlink = 1;
 	sb->st_uid = 0;
 	sb->st_gid = 0;
-	sb->st_size = -1;
+	sb->st_size = tftpfile->tsize;	/* -1 if the server didn't say */
 	return (0);
 }
 
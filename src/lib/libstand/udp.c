@@ -54,6 +54,123 @@
 #include "stand.h"
 #include "net.h"
 
+/*
+ * Reassembly of fragmented IPv4 datagrams, so UDP transfers (NFS reads,
+ * TFTP blocks) can be larger than the MTU.  A few datagrams may be in
+ * progress at once, as replies to pipelined requests interleave.  One
+ * that isn't complete after IPREASS_TIMEOUT seconds is dropped, and if
+ * all slots are busy the oldest gives way.
+ */
+#define IPREASS_MAX		4
+#define IPREASS_MAXFRAGS	64
+#define IPREASS_TIMEOUT		10	/* seconds */
+
+struct ipreass {
+	u_char		*ir_buf;	/* IP payload, NULL if slot free */
+	size_t		ir_size;	/* room in ir_buf */
+	size_t		ir_have;	/* bytes received so far */
+	size_t		ir_total;	/* payload length, 0 until known */
+	struct in_addr	ir_src;
+	u_short		ir_id;		/* net order */
+	time_t		ir_time;
+	int		ir_nfrags;
+	u_short		ir_frags[IPREASS_MAXFRAGS];	/* offsets seen */
+};
+
+static struct ipreass ipreass[IPREASS_MAX];
+
+static void
+ip_reass_free(struct ipreass *ir)
+{
+	free(ir->ir_buf);
+	ir->ir_buf = NULL;
+}
+
+/*
+ * Add the fragment at ip (header length hlen) to its datagram.  If that
+ * completes it, the whole datagram replaces the fragment in the caller's
+ * buffer, which has room for size bytes of IP payload, and its length
+ * including the IP header is returned.  Otherwise -1.
+ */
+static ssize_t
+ip_reass(struct ip *ip, size_t hlen, size_t size)
+{
+	struct ipreass *ir, *slot;
+	size_t off, len, total;
+	time_t now;
+	int i;
+
+	off = (ntohs(ip->ip_off) & IP_OFFMASK) << 3;
+	len = ntohs(ip->ip_len) - hlen;
+	now = getsecs();
+
+	slot = NULL;
+	for (ir = ipreass; ir < &ipreass[IPREASS_MAX]; ir++) {
+		if (ir->ir_buf != NULL && now - ir->ir_time > IPREASS_TIMEOUT)
+			ip_reass_free(ir);
+		if (ir->ir_buf == NULL) {
+			if (slot == NULL)
+				slot = ir;
+			continue;
+		}
+		if (ir->ir_id == ip->ip_id &&
+		    ir->ir_src.s_addr == ip->ip_src.s_addr)
+			break;
+	}
+	if (ir == &ipreass[IPREASS_MAX]) {
+		/* First fragment we see of this one */
+		if (slot == NULL) {
+			slot = ipreass;
+			for (ir = ipreass; ir < &ipreass[IPREASS_MAX]; ir++) {
+				if (ir->ir_time < slot->ir_time)
+					slot = ir;
+			}
+			ip_reass_free(slot);
+		}
+		ir = slot;
+		if ((ir->ir_buf = malloc(size)) == NULL)
+			return (-1);
+		ir->ir_size = size;
+		ir->ir_have = 0;
+		ir->ir_total = 0;
+		ir->ir_src = ip->ip_src;
+		ir->ir_id = ip->ip_id;
+		ir->ir_time = now;
+		ir->ir_nfrags = 0;
+	}
+
+	for (i = 0; i < ir->ir_nfrags; i++) {
+		if (ir->ir_frags[i] == off)
+			return (-1);		/* duplicate */
+	}
+	if (off + len > ir->ir_size || ir->ir_nfrags == IPREASS_MAXFRAGS) {
+		/* Won't fit, give up on the datagram. */
+		ip_reass_free(ir);
+		return (-1);
+	}
+	ir->ir_frags[ir->ir_nfrags++] = off;
+	bcopy((u_char *)ip + hlen, ir->ir_buf + off, len);
+	ir->ir_have += len;
+	if ((ntohs(ip->ip_off) & IP_MF) == 0)
+		ir->ir_total = off + len;
+
+	if (ir->ir_total == 0 || ir->ir_have < ir->ir_total)
+		return (-1);
+	total = ir->ir_total;
+	if (ir->ir_have != total || total > size) {
+		/* Overlapping fragments, or it doesn't fit this caller */
+		ip_reass_free(ir);
+		return (-1);
+	}
+
+	ip->ip_hl = sizeof(*ip) >> 2;
+	ip->ip_off = 0;
+	ip->ip_len = htons(sizeof(*ip) + total);
+	bcopy(ir->ir_buf, ip + 1, total);
+	ip_reass_free(ir);
+	return (sizeof(*ip) + total);
+}
+
 /* Caller must leave room for ethernet, ip and udp headers in front!! */
 ssize_t
 sendudp(struct iodesc *d, void *pkt, size_t len)
@@ -205,6 +322,14 @@ readudp(struct iodesc *d, void *pkt, size_t len, time_t tleft)
 		return -1;
 	}
 
+	/* Put fragments together, the checks below want the whole thing */
+	if (ip->ip_off & htons(IP_MF | IP_OFFMASK)) {
+		n = ip_reass(ip, hlen, len + sizeof(*uh));
+		if (n == -1)
+			return -1;
+		hlen = sizeof(*ip);
+	}
+
 	/* If there were ip options, make them go away */
 	if (hlen != sizeof(*ip)) {
 		bcopy(((u_char *)ip) + hlen, uh, len - hlen);
@@ -226,7 +351,7 @@ readudp(struct iodesc *d, void *pkt, size_t len, time_t tleft)
 		struct ip tip;
 
 		n = ntohs(uh->uh_ulen) + sizeof(*ip);
-		if (n > RECV_SIZE - ETHER_SIZE) {
+		if (n > len + sizeof(*ip) + sizeof(*uh)) {
 			printf("readudp: huge packet, udp len %d\n", (int)n);
 			return -1;
 		}
@@ -79,6 +79,7 @@ static int	ufs_read(struct open_file *f, void *buf, size_t size, size_t *resid);
 static off_t	ufs_seek(struct open_file *f, off_t offset, int where);
 static int	ufs_stat(struct open_file *f, struct stat *sb);
 static int	ufs_readdir(struct open_file *f, struct dirent *d);
+static void	ufs_unmount(void *data);
 
 struct fs_ops ufs_fsops = {
 	"ufs",
@@ -88,7 +89,8 @@ struct fs_ops ufs_fsops = {
 	null_write,
 	ufs_seek,
 	ufs_stat,
-	ufs_readdir
+	ufs_readdir,
+	ufs_unmount
 };
 
 /*
@@ -114,6 +116,7 @@ struct file {
 static int	read_inode(ino_t, struct open_file *);
 static int	block_map(struct open_file *, daddr_t, daddr_t *);
 static int	buf_read_file(struct open_file *, char **, size_t *);
+static int	direct_read_file(struct open_file *, char *, size_t, size_t *);
 static int	search_directory(char *, struct open_file *, ino_t *);
 #ifdef COMPAT_UFS
 static void	ffs_oldfscompat(struct fs *);
@@ -341,6 +344,69 @@ buf_read_file(struct open_file *f, char **buf_p, size_t *size_p)
 	return (0);
 }
 
+/*
+ * Read whole blocks of a file straight into the caller's buffer,
+ * bypassing f_buf.  Blocks which are physically contiguous are read
+ * with a single strategy call.  Return the number of bytes read in
+ * (*size_p), 0 if the caller has to go through buf_read_file() (not
+ * block aligned, a hole, a fragment or less than a block wanted).
+ *
+ * Parameters:
+ *	size_p:	out
+ */
+static int
+direct_read_file(struct open_file *f, char *addr, size_t size, size_t *size_p)
+{
+	struct file *fp = (struct file *)f->f_fsdata;
+	struct fs *fs = fp->f_fs;
+	daddr_t file_block;
+	daddr_t disk_block;
+	daddr_t next_block;
+	size_t nblks, n;
+	size_t rsize;
+	int rc;
+
+	*size_p = 0;
+	if (blkoff(fs, fp->f_seekp) != 0)
+		return (0);
+
+	/* whole blocks wanted and entirely within the file */
+	nblks = size / fs->fs_bsize;
+	n = (fp->f_di.di_size - fp->f_seekp) / fs->fs_bsize;
+	if (nblks > n)
+		nblks = n;
+	if (nblks == 0)
+		return (0);
+
+	file_block = lblkno(fs, fp->f_seekp);
+	if (dblksize(fs, &fp->f_di, file_block) != fs->fs_bsize)
+		return (0);
+	rc = block_map(f, file_block, &disk_block);
+	if (rc || disk_block == 0)
+		return (rc);
+
+	/* extend the run while the next block follows on disk */
+	for (n = 1; n < nblks; n++) {
+		if (dblksize(fs, &fp->f_di, file_block + n) != fs->fs_bsize)
+			break;
+		rc = block_map(f, file_block + n, &next_block);
+		if (rc)
+			return (rc);
+		if (next_block != disk_block + (daddr_t)n * fs->fs_frag)
+			break;
+	}
+
+	twiddle();
+	rc = (f->f_dev->dv_strategy)(f->f_devdata, F_READ,
+		fsbtodb(fs, disk_block), n * fs->fs_bsize, addr, &rsize);
+	if (rc)
+		return (rc);
+	if (rsize != n * fs->fs_bsize)
+		return (EIO);
+	*size_p = rsize;
+	return (0);
+}
+
 /*
  * Search a directory for a name and return its
  * i_number.
@@ -417,23 +483,30 @@ ufs_open(const char *upath, struct open_file *f)
 	bzero(fp, sizeof(struct file));
 	f->f_fsdata = (void *)fp;
 
-	/* allocate space and read super block */
-	fs = malloc(SBSIZE);
-	fp->f_fs = fs;
-	twiddle();
-	rc = (f->f_dev->dv_strategy)(f->f_devdata, F_READ,
-		SBOFF / DEV_BSIZE, SBSIZE, (char *)fs, &buf_size);
-	if (rc)
-		goto out;
-
-	if (buf_size != SBSIZE || fs->fs_magic != FS_MAGIC ||
-	    fs->fs_bsize > MAXBSIZE || fs->fs_bsize < sizeof(struct fs)) {
-		rc = EINVAL;
-		goto out;
-	}
+	/*
+	 * The super block is kept by the mount cache, only read it
+	 * the first time we see the device.
+	 */
+	if ((fs = f->f_mntdata) == NULL) {
+		fs = malloc(SBSIZE);
+		twiddle();
+		rc = (f->f_dev->dv_strategy)(f->f_devdata, F_READ,
+			SBOFF / DEV_BSIZE, SBSIZE, (char *)fs, &buf_size);
+		if (rc == 0 && (buf_size != SBSIZE || fs->fs_magic != FS_MAGIC ||
+		    fs->fs_bsize > MAXBSIZE || fs->fs_bsize < sizeof(struct fs)))
+			rc = EINVAL;
+		if (rc) {
+			f->f_fsdata = NULL;
+			free(fs);
+			free(fp);
+			return (rc);
+		}
 #ifdef COMPAT_UFS
-	ffs_oldfscompat(fs);
+		ffs_oldfscompat(fs);
 #endif
+		f->f_mntdata = fs;
+	}
+	fp->f_fs = fs;
 
 	/*
 	 * Calculate indirect block levels.
@@ -579,6 +652,7 @@ ufs_open(const char *upath, struct open_file *f)
 	 */
 	rc = 0;
 	fp->f_seekp = 0;
+	f->f_rasize = fs->fs_bsize;
 out:
 	if (buf)
 		free(buf);
@@ -588,7 +662,6 @@ out:
 		f->f_fsdata = NULL;
 		if (fp->f_buf)
 			free(fp->f_buf);
-		free(fp->f_fs);
 		free(fp);
 	}
 	return (rc);
@@ -610,11 +683,19 @@ ufs_close(struct open_file *f)
 	}
 	if (fp->f_buf)
 		free(fp->f_buf);
-	free(fp->f_fs);
 	free(fp);
 	return (0);
 }
 
+/*
+ * Release the super block once the mount cache is done with it.
+ */
+static void
+ufs_unmount(void *data)
+{
+	free(data);
+}
+
 /*
  * Copy a portion of a file into kernel memory.
  * Cross block boundaries when necessary.
@@ -636,15 +717,20 @@ ufs_read(struct open_file *f, void *start, size_t size, size_t *resid)
 		if (fp->f_seekp >= fp->f_di.di_size)
 			break;
 
-		rc = buf_read_file(f, &buf, &buf_size);
+		rc = direct_read_file(f, addr, size, &csize);
 		if (rc)
 			break;
+		if (csize == 0) {
+			rc = buf_read_file(f, &buf, &buf_size);
+			if (rc)
+				break;
 
-		csize = size;
-		if (csize > buf_size)
-			csize = buf_size;
+			csize = size;
+			if (csize > buf_size)
+				csize = buf_size;
 
-		bcopy(buf, addr, csize);
+			bcopy(buf, addr, csize);
+		}
 
 		fp->f_seekp += csize;
 		addr += csize;
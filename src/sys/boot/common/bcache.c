@@ -28,6 +28,15 @@
 
 /*
  * Simple LRU block cache
+ *
+ * Blocks are keyed by (device, unit, block number) and found through a
+ * hash table, so the cache can be made large and is shared by all disks
+ * without being flushed when the loader switches between them.  The
+ * device is identified by its low-level strategy routine.
+ *
+ * Sequential reads are detected per device and trigger read-ahead, so
+ * kernel and module loads turn into a few large device transfers rather
+ * than one per filesystem block.
  */
 
 #include <stand.h>
@@ -46,26 +55,66 @@
 # define DEBUG(fmt, args...)
 #endif
 
+/*
+ * Read-ahead window limits, in bytes.  The window starts at BCACHE_RA_MIN
+ * and doubles with each sequential miss, up to BCACHE_RA_MAX or a quarter
+ * of the cache, whichever is smaller.
+ */
+#define BCACHE_RA_MIN		(8 * 1024)
+#define BCACHE_RA_MAX		(256 * 1024)
+#define BCACHE_RA_STREAMS	4
+
+typedef int	(bcache_strategy_t)(void *devdata, int rw, daddr_t blk,
+			size_t size, char *buf, size_t *rsize);
 
 struct bcachectl
 {
-    daddr_t	bc_blkno;
-    time_t	bc_stamp;
-    int		bc_count;
+    LIST_ENTRY(bcachectl)	bc_hash;	/* hash chain, if valid */
+    TAILQ_ENTRY(bcachectl)	bc_lru;		/* MRU at head, free at tail */
+    bcache_strategy_t		*bc_dev;	/* NULL if invalid */
+    int				bc_unit;
+    daddr_t			bc_blkno;
+    time_t			bc_stamp;
+    caddr_t			bc_data;
 };
 
-static struct bcachectl	*bcache_ctl;
-static caddr_t		bcache_data;
-static bitstr_t		*bcache_miss;
-static u_int		bcache_nblks;
-static u_int		bcache_blksize;
-static u_int		bcache_hits, bcache_misses, bcache_ops, bcache_bypasses;
-static u_int		bcache_flushes;
-static u_int		bcache_bcount;
+/*
+ * Per-device sequential stream detection
+ */
+struct bcache_rastream
+{
+    bcache_strategy_t		*ra_dev;
+    int				ra_unit;
+    daddr_t			ra_next;	/* block following last request */
+    u_int			ra_nblks;	/* current window, 0 if random */
+};
 
-static void	bcache_invalidate(daddr_t blkno);
-static void	bcache_insert(caddr_t buf, daddr_t blkno);
-static int	bcache_lookup(caddr_t buf, daddr_t blkno);
+LIST_HEAD(bcache_hashhead, bcachectl);
+TAILQ_HEAD(bcache_lruhead, bcachectl);
+
+static struct bcachectl		*bcache_ctl;
+static struct bcache_hashhead	*bcache_hash;
+static struct bcache_lruhead	bcache_lru;
+static caddr_t			bcache_data;
+static bitstr_t			*bcache_miss;
+static u_int			bcache_nblks;
+static u_int			bcache_blksize;
+static u_int			bcache_hashmask;
+static u_int			bcache_inuse;
+static u_int			bcache_hits, bcache_misses, bcache_ops, bcache_bypasses;
+static u_int			bcache_flushes, bcache_evicts;
+static caddr_t			bcache_rabuf;
+static u_int			bcache_ramax;	/* in blocks */
+static struct bcache_rastream	bcache_ra[BCACHE_RA_STREAMS];
+static u_int			bcache_ranext;
+static u_int			bcache_raops, bcache_rablks, bcache_devops;
+
+static void	bcache_free(void);
+static void	bcache_invalidate(struct bcache_devdata *dd, int unit, daddr_t blkno);
+static void	bcache_insert(struct bcache_devdata *dd, int unit, caddr_t buf,
+			daddr_t blkno);
+static int	bcache_lookup(struct bcache_devdata *dd, int unit, caddr_t buf,
+			daddr_t blkno);
 
 /*
  * Initialise the cache for (nblks) of (bsize).
@@ -73,33 +122,64 @@ static int	bcache_lookup(caddr_t buf, daddr_t blkno);
 int
 bcache_init(u_int nblks, size_t bsize)
 {
+    u_int	nhash;
+
     /* discard any old contents */
-    if (bcache_data != NULL) {
-	free(bcache_data);
-	bcache_data = NULL;
-	free(bcache_ctl);
-    }
+    bcache_free();
+
+    /* one hash chain per two blocks, rounded up to a power of two */
+    for (nhash = 1; nhash < nblks / 2; nhash <<= 1)
+	;
 
     /* Allocate control structures */
     bcache_nblks = nblks;
     bcache_blksize = bsize;
+    bcache_hashmask = nhash - 1;
     bcache_data = malloc(bcache_nblks * bcache_blksize);
     bcache_ctl = (struct bcachectl *)malloc(bcache_nblks * sizeof(struct bcachectl));
+    bcache_hash = (struct bcache_hashhead *)malloc(nhash * sizeof(struct bcache_hashhead));
     bcache_miss = bit_alloc((bcache_nblks + 1) / 2);
-    if ((bcache_data == NULL) || (bcache_ctl == NULL) || (bcache_miss == NULL)) {
-	if (bcache_miss)
-	    free(bcache_miss);
-	if (bcache_ctl)
-	    free(bcache_ctl);
-	if (bcache_data)
-	    free(bcache_data);
-	bcache_data = NULL;
+    bcache_ramax = min(BCACHE_RA_MAX / bsize, nblks / 4);
+    if (bcache_ramax * bsize >= BCACHE_RA_MIN)
+	bcache_rabuf = malloc(bcache_ramax * bcache_blksize);
+    else
+	bcache_ramax = 0;
+    if ((bcache_data == NULL) || (bcache_ctl == NULL) || (bcache_hash == NULL) ||
+	(bcache_miss == NULL) || (bcache_ramax > 0 && bcache_rabuf == NULL)) {
+	bcache_free();
 	return(ENOMEM);
     }
 
+    bcache_flush();
+    bcache_flushes = 0;
     return(0);
 }
 
+/*
+ * Release the cache storage, leaving the cache inactive.
+ */
+static void
+bcache_free(void)
+{
+    if (bcache_rabuf)
+	free(bcache_rabuf);
+    if (bcache_miss)
+	free(bcache_miss);
+    if (bcache_hash)
+	free(bcache_hash);
+    if (bcache_ctl)
+	free(bcache_ctl);
+    if (bcache_data)
+	free(bcache_data);
+    bcache_rabuf = NULL;
+    bcache_ramax = 0;
+    bcache_miss = NULL;
+    bcache_hash = NULL;
+    bcache_ctl = NULL;
+    bcache_data = NULL;
+    bcache_nblks = 0;
+}
+
 /*
  * Flush the cache
  */
@@ -108,13 +188,27 @@ bcache_flush(void)
 {
     u_int	i;
 
+    /* Mounted file system state was read through us, drop it too */
+    mount_flush();
+
+    if (bcache_data == NULL)
+	return;
+
     bcache_flushes++;
 
     /* Flush the cache */
+    for (i = 0; i <= bcache_hashmask; i++)
+	LIST_INIT(&bcache_hash[i]);
+    TAILQ_INIT(&bcache_lru);
     for (i = 0; i < bcache_nblks; i++) {
-	bcache_ctl[i].bc_count = -1;
+	bcache_ctl[i].bc_dev = NULL;
+	bcache_ctl[i].bc_unit = -1;
 	bcache_ctl[i].bc_blkno = -1;
+	bcache_ctl[i].bc_data = bcache_data + (bcache_blksize * i);
+	TAILQ_INSERT_TAIL(&bcache_lru, &bcache_ctl[i], bc_lru);
     }
+    bcache_inuse = 0;
+    bzero(bcache_ra, sizeof(bcache_ra));
 }
 
 /*
@@ -122,7 +216,7 @@ bcache_flush(void)
  * cache with the new values.
  */
 static int
-write_strategy(void *devdata, int unit __unused, int rw, daddr_t blk, size_t size,
+write_strategy(void *devdata, int unit, int rw, daddr_t blk, size_t size,
 		char *buf, size_t *rsize)
 {
     struct bcache_devdata	*dd = (struct bcache_devdata *)devdata;
@@ -133,7 +227,7 @@ write_strategy(void *devdata, int unit __unused, int rw, daddr_t blk, size_t siz
 
     /* Invalidate the blocks being written */
     for (i = 0; i < nblk; i++) {
-	bcache_invalidate(blk + i);
+	bcache_invalidate(dd, unit, blk + i);
     }
 
     /* Write the blocks */
@@ -142,72 +236,132 @@ write_strategy(void *devdata, int unit __unused, int rw, daddr_t blk, size_t siz
     /* Populate the block cache with the new data */
     if (err == 0) {
 	for (i = 0; i < nblk; i++) {
-	    bcache_insert(buf + (i * bcache_blksize),blk + i);
+	    bcache_insert(dd, unit, buf + (i * bcache_blksize), blk + i);
 	}
     }
 
     return err;
 }
 
+/*
+ * Track sequential access for a device.  Returns the number of blocks to
+ * read ahead beyond a request of (nblk) at (blk), or zero if the access
+ * pattern doesn't look sequential.  Must be called once per request.
+ */
+static u_int
+bcache_rawindow(struct bcache_devdata *dd, int unit, daddr_t blk, daddr_t nblk,
+		int miss)
+{
+    struct bcache_rastream	*ra;
+    u_int			i, window;
+
+    if (bcache_ramax == 0)
+	return(0);
+
+    for (i = 0; i < BCACHE_RA_STREAMS; i++) {
+	ra = &bcache_ra[i];
+	if ((ra->ra_dev == dd->dv_strategy) && (ra->ra_unit == unit))
+	    break;
+    }
+    if (i == BCACHE_RA_STREAMS) {
+	ra = &bcache_ra[bcache_ranext++ % BCACHE_RA_STREAMS];
+	ra->ra_dev = dd->dv_strategy;
+	ra->ra_unit = unit;
+	ra->ra_next = -1;
+	ra->ra_nblks = 0;
+    }
+
+    window = 0;
+    if (blk == ra->ra_next) {
+	/* sequential; grow the window each time we run off its end */
+	if (miss) {
+	    if (ra->ra_nblks == 0)
+		ra->ra_nblks = BCACHE_RA_MIN / bcache_blksize;
+	    else
+		ra->ra_nblks = min(ra->ra_nblks * 2, bcache_ramax);
+	    window = ra->ra_nblks;
+	}
+    } else {
+	ra->ra_nblks = 0;
+    }
+    ra->ra_next = blk + nblk;
+    return(window);
+}
+
 /*
  * Handle a read request; fill in parts of the request that can
  * be satisfied by the cache, use the supplied strategy routine to do
  * device I/O and then use the I/O results to populate the cache.
+ *
+ * All misses are fetched with a single device transfer spanning the
+ * first to the last missing block; blocks in between that were hits are
+ * simply read again.  If the access is sequential and the misses run to
+ * the end of the request, the transfer is extended past the request and
+ * the extra blocks are added to the cache.
  */
 static int
-read_strategy(void *devdata, int unit __unused, int rw, daddr_t blk, size_t size,
+read_strategy(void *devdata, int unit, int rw, daddr_t blk, size_t size,
 		char *buf, size_t *rsize)
 {
     struct bcache_devdata	*dd = (struct bcache_devdata *)devdata;
-    int				p_size, result;
-    daddr_t			p_blk, i, j, nblk;
-    caddr_t			p_buf;
+    int				result;
+    daddr_t			i, nblk, first, last, p_size, ra;
 
     nblk = size / bcache_blksize;
     result = 0;
+    first = last = -1;
 
     /* Satisfy any cache hits up front */
     for (i = 0; i < nblk; i++) {
-	if (bcache_lookup(buf + (bcache_blksize * i), blk + i)) {
+	if (bcache_lookup(dd, unit, buf + (bcache_blksize * i), blk + i)) {
 	    bit_set(bcache_miss, i);	/* cache miss */
 	    bcache_misses++;
+	    if (first == -1)
+		first = i;
+	    last = i;
 	} else {
 	    bit_clear(bcache_miss, i);	/* cache hit */
 	    bcache_hits++;
 	}
     }
 
-    /* Go back and fill in any misses  XXX optimise */
-    p_blk = -1;
-    p_buf = NULL;
-    p_size = 0;
-    for (i = 0; i < nblk; i++) {
-	if (bit_test(bcache_miss, i)) {
-	    /* miss, add to pending transfer */
-	    if (p_blk == -1) {
-		p_blk = blk + i;
-		p_buf = buf + (bcache_blksize * i);
-		p_size = 1;
-	    } else {
-		p_size++;
+    ra = bcache_rawindow(dd, unit, blk, nblk, first != -1);
+    if (first == -1)
+	goto done;
+
+    /* Extend the transfer with read-ahead, if it fits the buffer */
+    p_size = nblk - first;
+    if ((ra > 0) && (last == nblk - 1) && (p_size < (daddr_t)bcache_ramax)) {
+	ra = min(ra, bcache_ramax - p_size);
+	bcache_devops++;
+	result = dd->dv_strategy(dd->dv_devdata, rw, blk + first,
+	    (p_size + ra) * bcache_blksize, bcache_rabuf, NULL);
+	if (result == 0) {
+	    bcopy(bcache_rabuf, buf + (bcache_blksize * first),
+		p_size * bcache_blksize);
+	    for (i = 0; i < p_size + ra; i++) {
+		if ((i >= p_size) || bit_test(bcache_miss, first + i))
+		    bcache_insert(dd, unit, bcache_rabuf + (i * bcache_blksize),
+			blk + first + i);
 	    }
-	} else if (p_blk != -1) {
-	    /* hit, complete pending transfer */
-	    result = dd->dv_strategy(dd->dv_devdata, rw, p_blk, p_size * bcache_blksize, p_buf, NULL);
-	    if (result != 0)
-		goto done;
-	    for (j = 0; j < p_size; j++)
-		bcache_insert(p_buf + (j * bcache_blksize), p_blk + j);
-	    p_blk = -1;
+	    bcache_raops++;
+	    bcache_rablks += ra;
+	    goto done;
 	}
+	/* possibly ran off the end of the device, retry without */
+	DEBUG("read-ahead of %d from %d failed", (int)ra, (int)(blk + nblk));
     }
-    if (p_blk != -1) {
-	/* pending transfer left */
-	result = dd->dv_strategy(dd->dv_devdata, rw, p_blk, p_size * bcache_blksize, p_buf, NULL);
-	if (result != 0)
-	    goto done;
-	for (j = 0; j < p_size; j++)
-	    bcache_insert(p_buf + (j * bcache_blksize), p_blk + j);
+
+    /* Go back and fill in the misses with a single transfer */
+    p_size = last - first + 1;
+    bcache_devops++;
+    result = dd->dv_strategy(dd->dv_devdata, rw, blk + first,
+	p_size * bcache_blksize, buf + (bcache_blksize * first), NULL);
+    if (result != 0)
+	goto done;
+    for (i = first; i <= last; i++) {
+	if (bit_test(bcache_miss, i))
+	    bcache_insert(dd, unit, buf + (i * bcache_blksize), blk + i);
     }
 
  done:
@@ -218,22 +372,16 @@ read_strategy(void *devdata, int unit __unused, int rw, daddr_t blk, size_t size
 
 /*
  * Requests larger than 1/2 the cache size will be bypassed and go
- * directly to the disk.  XXX tune this.
+ * directly to the disk.
  */
 int
 bcache_strategy(void *devdata, int unit, int rw, daddr_t blk, size_t size,
 		char *buf, size_t *rsize)
 {
-    static int			bcache_unit = -1;
     struct bcache_devdata	*dd = (struct bcache_devdata *)devdata;
 
     bcache_ops++;
 
-    if(bcache_unit != unit) {
-	bcache_flush();
-	bcache_unit = unit;
-    }
-
     /* bypass large requests, or when the cache is inactive */
     if ((bcache_data == NULL) || ((size * 2 / bcache_blksize) > bcache_nblks)) {
 	DEBUG("bypass %d from %d", size / bcache_blksize, blk);
@@ -250,81 +398,127 @@ bcache_strategy(void *devdata, int unit, int rw, daddr_t blk, size_t size,
     return -1;
 }
 
+/*
+ * Hash chain for a (device, unit, block) key.
+ */
+static struct bcache_hashhead *
+bcache_hashchain(bcache_strategy_t *dev, int unit, daddr_t blkno)
+{
+    u_int	h;
+
+    h = (u_int)((uintptr_t)dev >> 4);
+    h ^= (u_int)unit * 0x9e3779b1U;
+    h ^= (u_int)blkno ^ (u_int)((uint64_t)blkno >> 32);
+    return(&bcache_hash[h & bcache_hashmask]);
+}
 
 /*
- * Insert a block into the cache.  Retire the oldest block to do so, if required.
- *
- * XXX the LRU algorithm will fail after 2^31 blocks have been transferred.
+ * Find the cache entry for a block, or NULL if it isn't cached.
+ */
+static struct bcachectl *
+bcache_find(struct bcache_devdata *dd, int unit, daddr_t blkno)
+{
+    struct bcachectl	*bc;
+
+    LIST_FOREACH(bc, bcache_hashchain(dd->dv_strategy, unit, blkno), bc_hash) {
+	if ((bc->bc_blkno == blkno) && (bc->bc_unit == unit) &&
+	    (bc->bc_dev == dd->dv_strategy))
+	    return(bc);
+    }
+    return(NULL);
+}
+
+/*
+ * Drop an entry from its hash chain and move it to the free end of the
+ * LRU list.
  */
 static void
-bcache_insert(caddr_t buf, daddr_t blkno)
+bcache_release(struct bcachectl *bc)
 {
-    time_t	now;
-    int		cand, ocount;
-    u_int	i;
+    LIST_REMOVE(bc, bc_hash);
+    TAILQ_REMOVE(&bcache_lru, bc, bc_lru);
+    TAILQ_INSERT_TAIL(&bcache_lru, bc, bc_lru);
+    bc->bc_dev = NULL;
+    bc->bc_unit = -1;
+    bc->bc_blkno = -1;
+    bcache_inuse--;
+}
+
+/*
+ * Insert a block into the cache.  Retire the least recently used block
+ * to do so, if required.
+ */
+static void
+bcache_insert(struct bcache_devdata *dd, int unit, caddr_t buf, daddr_t blkno)
+{
+    struct bcachectl	*bc;
+    time_t		now;
 
     time(&now);
-    cand = 0;				/* assume the first block */
-    ocount = bcache_ctl[0].bc_count;
-
-    /* find the oldest block */
-    for (i = 1; i < bcache_nblks; i++) {
-	if (bcache_ctl[i].bc_blkno == blkno) {
-	    /* reuse old entry */
-	    cand = i;
-	    break;
-	}
-	if (bcache_ctl[i].bc_count < ocount) {
-	    ocount = bcache_ctl[i].bc_count;
-	    cand = i;
+
+    if ((bc = bcache_find(dd, unit, blkno)) == NULL) {
+	/* take the least recently used (or a free) block */
+	bc = TAILQ_LAST(&bcache_lru, bcache_lruhead);
+	if (bc->bc_dev != NULL) {
+	    bcache_release(bc);
+	    bcache_evicts++;
 	}
+	bc->bc_dev = dd->dv_strategy;
+	bc->bc_unit = unit;
+	bc->bc_blkno = blkno;
+	LIST_INSERT_HEAD(bcache_hashchain(dd->dv_strategy, unit, blkno), bc, bc_hash);
+	bcache_inuse++;
     }
 
-    DEBUG("insert blk %d -> %d @ %d # %d", blkno, cand, now, bcache_bcount);
-    bcopy(buf, bcache_data + (bcache_blksize * cand), bcache_blksize);
-    bcache_ctl[cand].bc_blkno = blkno;
-    bcache_ctl[cand].bc_stamp = now;
-    bcache_ctl[cand].bc_count = bcache_bcount++;
+    DEBUG("insert blk %d -> %d @ %d", blkno, (int)(bc - bcache_ctl), now);
+    bcopy(buf, bc->bc_data, bcache_blksize);
+    bc->bc_stamp = now;
+    TAILQ_REMOVE(&bcache_lru, bc, bc_lru);
+    TAILQ_INSERT_HEAD(&bcache_lru, bc, bc_lru);
 }
 
 /*
- * Look for a block in the cache.  Blocks more than BCACHE_TIMEOUT seconds old
- * may be stale (removable media) and thus are discarded.  Copy the block out
- * if successful and return zero, or return nonzero on failure.
+ * Look for a block in the cache.  On volatile (removable) devices blocks
+ * more than BCACHE_TIMEOUT seconds old may be stale and are discarded.
+ * Copy the block out if successful and return zero, or return nonzero on
+ * failure.
  */
 static int
-bcache_lookup(caddr_t buf, daddr_t blkno)
+bcache_lookup(struct bcache_devdata *dd, int unit, caddr_t buf, daddr_t blkno)
 {
-    time_t	now;
-    u_int	i;
-
-    time(&now);
-
-    for (i = 0; i < bcache_nblks; i++)
-	/* cache hit? */
-	if ((bcache_ctl[i].bc_blkno == blkno) && ((bcache_ctl[i].bc_stamp + BCACHE_TIMEOUT) >= now)) {
-	    bcopy(bcache_data + (bcache_blksize * i), buf, bcache_blksize);
-	    DEBUG("hit blk %d <- %d (now %d then %d)", blkno, i, now, bcache_ctl[i].bc_stamp);
-	    return(0);
+    struct bcachectl	*bc;
+    time_t		now;
+
+    if ((bc = bcache_find(dd, unit, blkno)) == NULL)
+	return(ENOENT);
+
+    if (dd->dv_flags & BCACHE_F_VOLATILE) {
+	time(&now);
+	if ((bc->bc_stamp + BCACHE_TIMEOUT) < now) {
+	    DEBUG("stale blk %d (now %d then %d)", blkno, now, bc->bc_stamp);
+	    bcache_release(bc);
+	    return(ENOENT);
 	}
-    return(ENOENT);
+    }
+
+    bcopy(bc->bc_data, buf, bcache_blksize);
+    TAILQ_REMOVE(&bcache_lru, bc, bc_lru);
+    TAILQ_INSERT_HEAD(&bcache_lru, bc, bc_lru);
+    DEBUG("hit blk %d <- %d", blkno, (int)(bc - bcache_ctl));
+    return(0);
 }
 
 /*
  * Invalidate a block from the cache.
  */
 static void
-bcache_invalidate(daddr_t blkno)
+bcache_invalidate(struct bcache_devdata *dd, int unit, daddr_t blkno)
 {
-    u_int	i;
+    struct bcachectl	*bc;
 
-    for (i = 0; i < bcache_nblks; i++) {
-	if (bcache_ctl[i].bc_blkno == blkno) {
-	    bcache_ctl[i].bc_count = -1;
-	    bcache_ctl[i].bc_blkno = -1;
-	    DEBUG("invalidate blk %d", blkno);
-	    break;
-	}
+    if ((bc = bcache_find(dd, unit, blkno)) != NULL) {
+	bcache_release(bc);
+	DEBUG("invalidate blk %d", blkno);
     }
 }
 
@@ -333,13 +527,12 @@ COMMAND_SET(bcachestat, "bcachestat", "get disk block cache stats", command_bcac
 static int
 command_bcache(int argc __unused, char *argv[] __unused)
 {
-    u_int	i;
-
-    for (i = 0; i < bcache_nblks; i++) {
-	printf("%08jx %04x %04x|", (uintmax_t)bcache_ctl[i].bc_blkno, (unsigned int)bcache_ctl[i].bc_stamp & 0xffff, bcache_ctl[i].bc_count & 0xffff);
-	if (((i + 1) % 4) == 0)
-	    printf("\n");
-    }
-    printf("\n%u ops  %u bypasses  %u hits  %u misses  %u flushes\n", bcache_ops, bcache_bypasses, bcache_hits, bcache_misses, bcache_flushes);
+    printf("%u blocks of %u bytes, %u in use, %u hash chains\n",
+	bcache_nblks, bcache_blksize, bcache_inuse, bcache_hashmask + 1);
+    printf("%u ops  %u bypasses  %u hits  %u misses  %u evicts  %u flushes\n",
+	bcache_ops, bcache_bypasses, bcache_hits, bcache_misses, bcache_evicts,
+	bcache_flushes);
+    printf("%u device reads  %u read-aheads  %u blocks read ahead (max %u)\n",
+	bcache_devops, bcache_raops, bcache_rablks, bcache_ramax);
     return(CMD_OK);
 }
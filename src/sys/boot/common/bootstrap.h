@@ -84,6 +84,7 @@ char	*unargv(int argc, char *argv[]);
 void	hexdump(caddr_t region, size_t len);
 size_t	strlenout(vm_offset_t str);
 char	*strdupout(vm_offset_t str);
+void	*alloc_copyout(vm_offset_t src, size_t len);
 void	kern_bzero(vm_offset_t dest, size_t len);
 int	kern_pread(int fd, vm_offset_t dest, size_t len, off_t off);
 void	*alloc_pread(int fd, off_t off, size_t len);
@@ -103,6 +104,8 @@ struct bcache_devdata
 {
     int         (*dv_strategy)(void *devdata, int rw, daddr_t blk, size_t size, char *buf, size_t *rsize);
     void	*dv_devdata;
+    int		dv_flags;
+#define BCACHE_F_VOLATILE	(1<<0)	/* removable media, expire stale blocks */
 };
 
 /*
@@ -299,6 +302,8 @@ struct arch_switch
     int		(*arch_autoload)(void);
     /* Locate the device for (name), return pointer to tail in (*path) */
     int		(*arch_getdev)(void **dev, const char *name, const char **path);
+    /* Format a device returned by arch_getdev, NULL if not supported */
+    char	*(*arch_fmtdev)(void *dev);
     /* Copy from local address space to module address space, similar to bcopy() */
     ssize_t	(*arch_copyin)(const void *src, vm_offset_t dest,
 			       const size_t len);
@@ -507,6 +507,19 @@ command_lsdev(int argc, char *argv[])
     return(CMD_OK);
 }
 
+/*
+ * Network request/retransmit counters and round trip estimates
+ */
+COMMAND_SET(netstat, "netstat", "show network retransmit statistics",
+    command_netstat);
+
+static int
+command_netstat(int argc __unused, char *argv[] __unused)
+{
+    netstats();
+    return(CMD_OK);
+}
+
 /*
  * CONDITIONALS
  */
@@ -81,3 +81,16 @@ devreplace(struct open_file *f, void *devdata)
 	}
 	f->f_devdata = devdata;
 }
+
+/*
+ * Name the device (f) is open on, for libstand's mount cache.  Devices
+ * which replaced the generic devdesc can't be named and aren't cached.
+ */
+char *
+devformat(struct open_file *f)
+{
+	if (!(f->f_flags & F_DEVDESC) || f->f_devdata == NULL ||
+	    archsw.arch_fmtdev == NULL)
+		return (NULL);
+	return (archsw.arch_fmtdev(f->f_devdata));
+}
@@ -42,6 +42,10 @@
 
 #define COPYOUT(s,d,l)	archsw.arch_copyout((vm_offset_t)(s), d, l)
 
+#ifndef DT_GNU_HASH
+#define DT_GNU_HASH	0x6ffffef5
+#endif
+
 #if defined(__i386__) && __ELF_WORD_SIZE == 64
 #undef ELF_TARG_CLASS
 #undef ELF_TARG_MACH
@@ -58,12 +62,24 @@ typedef struct elf_file {
     Elf_Hashelt	nchains;
     Elf_Hashelt	*buckets;
     Elf_Hashelt	*chains;
+    u_int32_t	*gnuhash;	/* DT_GNU_HASH, preferred if present */
+    u_int32_t	gnu_nbuckets;
+    u_int32_t	gnu_symoffset;
+    u_int32_t	gnu_bloomsize;
+    u_int32_t	gnu_bloomshift;
+    Elf_Addr	*gnu_bloom;
+    u_int32_t	*gnu_buckets;
+    u_int32_t	*gnu_chains;
     Elf_Rel	*rel;
     size_t	relsz;
     Elf_Rela	*rela;
     size_t	relasz;
+    Elf_Rel	*relmem;	/* rel, rela and index read in by reloc_index */
+    Elf_Rela	*relamem;
+    u_int	*relidx;
     char	*strtab;
     size_t	strsz;
+    char	*strmem;	/* strtab read in, for symbol lookups */
     int		fd;
     caddr_t	firstpage;
     size_t	firstlen;
@@ -287,6 +303,7 @@ __elfN(loadimage)(struct preloaded_file *fp, elf_file_t ef, u_int64_t off)
     int		symtabindex;
     Elf_Size	size;
     u_int	fpcopy;
+    u_int32_t	gnuhdr[4];
 
     dp = NULL;
     shdr = NULL;
@@ -497,10 +514,9 @@ nosyms:
     ndp = php->p_filesz / sizeof(Elf_Dyn);
     if (ndp == 0)
 	goto out;
-    dp = malloc(php->p_filesz);
+    dp = alloc_copyout(php->p_vaddr + off, php->p_filesz);
     if (dp == NULL)
 	goto out;
-    archsw.arch_copyout(php->p_vaddr + off, dp, php->p_filesz);
 
     ef->strsz = 0;
     for (i = 0; i < ndp; i++) {
@@ -510,6 +526,9 @@ nosyms:
 	case DT_HASH:
 	    ef->hashtab = (Elf_Hashelt*)(uintptr_t)(dp[i].d_un.d_ptr + off);
 	    break;
+	case DT_GNU_HASH:
+	    ef->gnuhash = (u_int32_t *)(uintptr_t)(dp[i].d_un.d_ptr + off);
+	    break;
 	case DT_STRTAB:
 	    ef->strtab = (char *)(uintptr_t)(dp[i].d_un.d_ptr + off);
 	    break;
@@ -535,13 +554,34 @@ nosyms:
 	    break;
 	}
     }
-    if (ef->hashtab == NULL || ef->symtab == NULL ||
+    if ((ef->hashtab == NULL && ef->gnuhash == NULL) || ef->symtab == NULL ||
 	ef->strtab == NULL || ef->strsz == 0)
 	goto out;
-    COPYOUT(ef->hashtab, &ef->nbuckets, sizeof(ef->nbuckets));
-    COPYOUT(ef->hashtab + 1, &ef->nchains, sizeof(ef->nchains));
-    ef->buckets = ef->hashtab + 2;
-    ef->chains = ef->buckets + ef->nbuckets;
+    if (ef->hashtab != NULL) {
+	COPYOUT(ef->hashtab, &ef->nbuckets, sizeof(ef->nbuckets));
+	COPYOUT(ef->hashtab + 1, &ef->nchains, sizeof(ef->nchains));
+	ef->buckets = ef->hashtab + 2;
+	ef->chains = ef->buckets + ef->nbuckets;
+    }
+    if (ef->gnuhash != NULL) {
+	COPYOUT(ef->gnuhash, gnuhdr, sizeof(gnuhdr));
+	ef->gnu_nbuckets = gnuhdr[0];
+	ef->gnu_symoffset = gnuhdr[1];
+	ef->gnu_bloomsize = gnuhdr[2];
+	ef->gnu_bloomshift = gnuhdr[3];
+	ef->gnu_bloom = (Elf_Addr *)(ef->gnuhash + 4);
+	ef->gnu_buckets = (u_int32_t *)(ef->gnu_bloom + ef->gnu_bloomsize);
+	ef->gnu_chains = ef->gnu_buckets + ef->gnu_nbuckets;
+	if (ef->gnu_nbuckets == 0 || ef->gnu_bloomsize == 0)
+	    ef->gnuhash = NULL;
+	if (ef->gnuhash == NULL && ef->hashtab == NULL)
+	    goto out;
+    }
+    /* Symbol names are compared in place if we can have a copy */
+    if ((ef->strmem = malloc(ef->strsz + 1)) != NULL) {
+	COPYOUT(ef->strtab, ef->strmem, ef->strsz);
+	ef->strmem[ef->strsz] = '\0';
+    }
     if (__elfN(parse_modmetadata)(fp, ef) == 0)
 	goto out;
 
@@ -549,6 +589,18 @@ nosyms:
 	goto out;
 
 out:
+    if (ef->strmem)
+	free(ef->strmem);
+    ef->strmem = NULL;
+    if (ef->relidx)
+	free(ef->relidx);
+    if (ef->relmem)
+	free(ef->relmem);
+    if (ef->relamem)
+	free(ef->relamem);
+    ef->relidx = NULL;
+    ef->relmem = NULL;
+    ef->relamem = NULL;
     if (dp)
 	free(dp);
     if (shdr)
@@ -695,16 +747,113 @@ elf_hash(const char *name)
     return h;
 }
 
+/* GNU hash function, for DT_GNU_HASH */
+static u_int32_t
+gnu_hash(const char *name)
+{
+    const unsigned char *p = (const unsigned char *) name;
+    u_int32_t h = 5381;
+
+    while (*p != '\0')
+	h = (h << 5) + h + *p++;
+    return h;
+}
+
+/*
+ * Does the name of (sym) match (name)?
+ */
+static int
+__elfN(symname_is)(elf_file_t ef, const Elf_Sym *sym, const char *name)
+{
+    char *strp;
+    int match;
+
+    if (sym->st_name >= ef->strsz)
+	return 0;
+    if (ef->strmem != NULL)
+	return (strcmp(name, ef->strmem + sym->st_name) == 0);
+    strp = strdupout((vm_offset_t)(ef->strtab + sym->st_name));
+    match = (strcmp(name, strp) == 0);
+    free(strp);
+    return match;
+}
+
+/*
+ * We found the symbol by name; is it one we can use?
+ */
+static int
+__elfN(symfound)(const Elf_Sym *sym, Elf_Sym *symp)
+{
+    if (sym->st_shndx != SHN_UNDEF ||
+	(sym->st_value != 0 && ELF_ST_TYPE(sym->st_info) == STT_FUNC)) {
+	*symp = *sym;
+	return 0;
+    }
+    return ENOENT;
+}
+
 static const char __elfN(bad_symtable)[] = "elf" __XSTRING(__ELF_WORD_SIZE) "_lookup_symbol: corrupt symbol table\n";
+
+/*
+ * Look (name) up through the DT_GNU_HASH table.  The Bloom filter rules
+ * out most names that aren't there without touching the chains.
+ */
+static int
+__elfN(lookup_gnu)(elf_file_t ef, const char *name, Elf_Sym *symp)
+{
+    Elf_Addr word, mask;
+    u_int32_t hash, h2, symnum;
+    Elf_Sym sym;
+
+    hash = gnu_hash(name);
+    COPYOUT(&ef->gnu_bloom[(hash / __ELF_WORD_SIZE) % ef->gnu_bloomsize],
+	&word, sizeof(word));
+    mask = ((Elf_Addr)1 << (hash % __ELF_WORD_SIZE)) |
+	((Elf_Addr)1 << ((hash >> ef->gnu_bloomshift) % __ELF_WORD_SIZE));
+    if ((word & mask) != mask)
+	return ENOENT;
+
+    COPYOUT(&ef->gnu_buckets[hash % ef->gnu_nbuckets], &symnum,
+	sizeof(symnum));
+    if (symnum == STN_UNDEF)
+	return ENOENT;
+    if (symnum < ef->gnu_symoffset) {
+	printf(__elfN(bad_symtable));
+	return ENOENT;
+    }
+
+    for (;; symnum++) {
+	if (ef->hashtab != NULL && symnum >= ef->nchains) {
+	    printf(__elfN(bad_symtable));
+	    return ENOENT;
+	}
+	COPYOUT(&ef->gnu_chains[symnum - ef->gnu_symoffset], &h2, sizeof(h2));
+	if ((h2 | 1) == (hash | 1)) {
+	    COPYOUT(ef->symtab + symnum, &sym, sizeof(sym));
+	    if (sym.st_name == 0) {
+		printf(__elfN(bad_symtable));
+		return ENOENT;
+	    }
+	    if (__elfN(symname_is)(ef, &sym, name))
+		return (__elfN(symfound)(&sym, symp));
+	}
+	if (h2 & 1)			/* end of chain */
+	    break;
+    }
+    return ENOENT;
+}
+
 int
 __elfN(lookup_symbol)(struct preloaded_file *fp __unused, elf_file_t ef,
 		      const char* name, Elf_Sym *symp)
 {
     Elf_Hashelt symnum;
     Elf_Sym sym;
-    char *strp;
     unsigned long hash;
 
+    if (ef->gnuhash != NULL)
+	return (__elfN(lookup_gnu)(ef, name, symp));
+
     hash = elf_hash(name);
     COPYOUT(&ef->buckets[hash % ef->nbuckets], &symnum, sizeof(symnum));
 
@@ -720,23 +869,110 @@ __elfN(lookup_symbol)(struct preloaded_file *fp __unused, elf_file_t ef,
 	    return ENOENT;
 	}
 
-	strp = strdupout((vm_offset_t)(ef->strtab + sym.st_name));
-	if (strcmp(name, strp) == 0) {
-	    free(strp);
-	    if (sym.st_shndx != SHN_UNDEF ||
-		(sym.st_value != 0 &&
-		 ELF_ST_TYPE(sym.st_info) == STT_FUNC)) {
-		*symp = sym;
-		return 0;
-	    }
-	    return ENOENT;
-	}
-	free(strp);
+	if (__elfN(symname_is)(ef, &sym, name))
+	    return (__elfN(symfound)(&sym, symp));
 	COPYOUT(&ef->chains[symnum], &symnum, sizeof(symnum));
     }
     return ENOENT;
 }
 
+/*
+ * Relocation entry (e) of the module, numbering the REL entries first and
+ * the RELA entries after them, as read in by reloc_index().
+ */
+static Elf_Addr
+__elfN(reloc_off)(elf_file_t ef, u_int e)
+{
+	size_t nrel = ef->relsz / sizeof(Elf_Rel);
+
+	if (e < nrel)
+		return (ef->relmem[e].r_offset);
+	return (ef->relamem[e - nrel].r_offset);
+}
+
+/*
+ * Order index slots by target offset, keeping table order for entries
+ * with the same offset.
+ */
+static int
+__elfN(reloc_before)(elf_file_t ef, u_int a, u_int b)
+{
+	Elf_Addr oa, ob;
+
+	oa = __elfN(reloc_off)(ef, ef->relidx[a]);
+	ob = __elfN(reloc_off)(ef, ef->relidx[b]);
+	return (oa < ob || (oa == ob && ef->relidx[a] < ef->relidx[b]));
+}
+
+static void
+__elfN(reloc_sift)(elf_file_t ef, size_t root, size_t n)
+{
+	size_t child;
+	u_int e;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n &&
+		    __elfN(reloc_before)(ef, child, child + 1))
+			child++;
+		if (!__elfN(reloc_before)(ef, root, child))
+			return;
+		e = ef->relidx[root];
+		ef->relidx[root] = ef->relidx[child];
+		ef->relidx[child] = e;
+		root = child;
+	}
+}
+
+/*
+ * Read the relocation tables of the module in once and sort an index
+ * of them by target offset (heapsort; we have no qsort here), so that
+ * reloc_ptr() can binary search for the entries that apply to a value.
+ */
+static int
+__elfN(reloc_index)(elf_file_t ef)
+{
+	size_t nrel, nrela, n, i;
+	u_int e;
+
+	if (ef->relidx != NULL)
+		return (0);
+	nrel = ef->relsz / sizeof(Elf_Rel);
+	nrela = ef->relasz / sizeof(Elf_Rela);
+	n = nrel + nrela;
+	if (n == 0)
+		return (ENOENT);
+
+	if (nrel > 0 && (ef->relmem = alloc_copyout((vm_offset_t)ef->rel,
+	    nrel * sizeof(Elf_Rel))) == NULL)
+		goto nomem;
+	if (nrela > 0 && (ef->relamem = alloc_copyout((vm_offset_t)ef->rela,
+	    nrela * sizeof(Elf_Rela))) == NULL)
+		goto nomem;
+	if ((ef->relidx = malloc(n * sizeof(*ef->relidx))) == NULL)
+		goto nomem;
+
+	for (i = 0; i < n; i++)
+		ef->relidx[i] = i;
+	for (i = n / 2; i-- > 0; )
+		__elfN(reloc_sift)(ef, i, n);
+	for (i = n - 1; i > 0; i--) {
+		e = ef->relidx[0];
+		ef->relidx[0] = ef->relidx[i];
+		ef->relidx[i] = e;
+		__elfN(reloc_sift)(ef, 0, i);
+	}
+	return (0);
+
+nomem:
+	if (ef->relmem != NULL)
+		free(ef->relmem);
+	if (ef->relamem != NULL)
+		free(ef->relamem);
+	ef->relmem = NULL;
+	ef->relamem = NULL;
+	return (ENOMEM);
+}
+
 /*
  * Apply any intra-module relocations to the value. p is the load address
  * of the value and val/len is the value to be modified. This does NOT modify
@@ -748,9 +984,11 @@ static int
 __elfN(reloc_ptr)(struct preloaded_file *mp __unused, elf_file_t ef,
     Elf_Addr p, void *val, size_t len)
 {
-	size_t n;
+	size_t n, nrel, lo, hi, mid;
+	Elf_Addr target;
 	Elf_Rela a;
 	Elf_Rel r;
+	u_int e;
 	int error;
 
 	/*
@@ -760,6 +998,42 @@ __elfN(reloc_ptr)(struct preloaded_file *mp __unused, elf_file_t ef,
 	if (ef->kernel)
 		return (EOPNOTSUPP);
 
+	/*
+	 * Only entries with r_offset in [target, target + len) can touch
+	 * the value; find the first of them.
+	 */
+	if (__elfN(reloc_index)(ef) == 0) {
+		nrel = ef->relsz / sizeof(Elf_Rel);
+		n = nrel + ef->relasz / sizeof(Elf_Rela);
+		target = p - ef->off;
+		lo = 0;
+		hi = n;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (__elfN(reloc_off)(ef, ef->relidx[mid]) < target)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (; lo < n; lo++) {
+			e = ef->relidx[lo];
+			if (__elfN(reloc_off)(ef, e) - target >= len)
+				break;
+			if (e < nrel)
+				error = __elfN(reloc)(ef, __elfN(symaddr),
+				    &ef->relmem[e], ELF_RELOC_REL, ef->off, p,
+				    val, len);
+			else
+				error = __elfN(reloc)(ef, __elfN(symaddr),
+				    &ef->relamem[e - nrel], ELF_RELOC_RELA,
+				    ef->off, p, val, len);
+			if (error != 0)
+				return (error);
+		}
+		return (0);
+	}
+
+	/* No memory for the index, try them all */
 	for (n = 0; n < ef->relsz / sizeof(r); n++) {
 		COPYOUT(ef->rel + n, &r, sizeof(r));
 
@@ -58,19 +58,64 @@ unargv(int argc, char *argv[])
     return(cp);
 }
 
+/*
+ * Strings in kernel space are copied out this many bytes at a time
+ * rather than one by one.
+ */
+#define COPYOUT_CHUNK	128
+
+/*
+ * Copy out up to (len) bytes at (src), trying smaller pieces if that
+ * runs off the end of what arch_copyout() can reach.  Returns the number
+ * of bytes copied.
+ */
+static size_t
+copyout_chunk(vm_offset_t src, void *buf, size_t len)
+{
+    for (; len > 0; len /= 2) {
+	if (archsw.arch_copyout(src, buf, len) == (ssize_t)len)
+	    return(len);
+    }
+    return(0);
+}
+
+/*
+ * Offset of the first NUL in (buf), or (len) if there is none.  (buf)
+ * must be word aligned; it is scanned a word at a time.
+ */
+static size_t
+chunk_strnlen(const char *buf, size_t len)
+{
+    const u_long	ones = ~0UL / 0xff;
+    const u_long	*wp;
+    size_t		i;
+
+    for (i = 0; i + sizeof(u_long) <= len; i += sizeof(u_long)) {
+	wp = (const u_long *)(buf + i);
+	if (((*wp - ones) & ~*wp & (ones << 7)) != 0)
+	    break;
+    }
+    for (; i < len; i++) {
+	if (buf[i] == 0)
+	    break;
+    }
+    return(i);
+}
+
 /*
  * Get the length of a string in kernel space
  */
 size_t
 strlenout(vm_offset_t src)
 {
-    char	c;
-    size_t	len;
+    u_long	buf[COPYOUT_CHUNK / sizeof(u_long)];
+    size_t	len, got, n;
 
-    for (len = 0; ; len++) {
-	archsw.arch_copyout(src++, &c, 1);
-	if (c == 0)
+    for (len = 0; ; len += got) {
+	if ((got = copyout_chunk(src + len, buf, sizeof(buf))) == 0)
 	    break;
+	if ((n = chunk_strnlen((char *)buf, got)) < got)
+	    return(len + n);
     }
     return(len);
 }
@@ -81,17 +126,45 @@ strlenout(vm_offset_t src)
 char *
 strdupout(vm_offset_t str)
 {
+    u_long	buf[COPYOUT_CHUNK / sizeof(u_long)];
     char	*result, *cp;
+    size_t	len, got, n;
 
-    result = malloc(strlenout(str) + 1);
-    for (cp = result; ;cp++) {
-	archsw.arch_copyout(str++, cp, 1);
-	if (*cp == 0)
+    result = NULL;
+    for (len = 0; ; len += n) {
+	got = copyout_chunk(str + len, buf, sizeof(buf));
+	n = chunk_strnlen((char *)buf, got);
+	if ((cp = realloc(result, len + n + 1)) == NULL) {
+	    free(result);
+	    return(NULL);
+	}
+	result = cp;
+	bcopy(buf, result + len, n);
+	if (n < got || got == 0)
 	    break;
     }
+    result[len + n] = 0;
     return(result);
 }
 
+/*
+ * Copy a structure or table in kernel space to a malloced buffer in
+ * one go.
+ */
+void *
+alloc_copyout(vm_offset_t src, size_t len)
+{
+    void	*buf;
+
+    if ((buf = malloc(len)) == NULL)
+	return(NULL);
+    if (archsw.arch_copyout(src, buf, len) != (ssize_t)len) {
+	free(buf);
+	return(NULL);
+    }
+    return(buf);
+}
+
 /* Zero a region in kernel space. */
 void
 kern_bzero(vm_offset_t dest, size_t len)
@@ -210,6 +283,9 @@ dev_cleanup(void)
 {
     int		i;
 
+    /* Drop cached file system state before the devices go away */
+    mount_flush();
+
     /* Call cleanup routines */
     for (i = 0; devsw[i] != NULL; ++i)
 	if (devsw[i]->dv_cleanup != NULL)
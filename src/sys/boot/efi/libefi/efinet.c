@@ -153,8 +153,12 @@ efinet_get(struct iodesc *desc, void *pkt, size_t len, time_t timeout)
 
 	net = nif->nif_devdata;
 
+	/*
+	 * Always poll at least once; sendrecv() passes a zero timeout
+	 * when it wants a reply sooner than a second from now.
+	 */
 	t = time(0);
-	while ((time(0) - t) < timeout) {
+	do {
 		bufsz = sizeof(buf);
 		status = net->Receive(net, 0, &bufsz, buf, 0, 0, 0);
 		if (status == EFI_SUCCESS) {
@@ -171,7 +175,7 @@ efinet_get(struct iodesc *desc, void *pkt, size_t len, time_t timeout)
 		}
 		if (status != EFI_NOT_READY)
 			return (0);
-	}
+	} while ((time(0) - t) < timeout);
 
 	return (0);
 }
@@ -43,6 +43,8 @@ static EFI_GUID devpath_guid = DEVICE_PATH_PROTOCOL;
 
 static int efipart_init(void);
 static int efipart_strategy(void *, int, daddr_t, size_t, char *, size_t *);
+static int efipart_realstrategy(void *, int, daddr_t, size_t, char *,
+    size_t *);
 static int efipart_open(struct open_file *, ...);
 static int efipart_close(struct open_file *);
 static void efipart_print(int);
@@ -254,9 +256,29 @@ efipart_readwrite(EFI_BLOCK_IO *blkio, int rw, daddr_t blk, daddr_t nblks,
 	return (efi_status_to_errno(status));
 }
 
+/*
+ * All filesystem I/O goes through the disk block cache; only cache
+ * misses reach efipart_realstrategy() and the firmware.
+ */
 static int
 efipart_strategy(void *devdata, int rw, daddr_t blk, size_t size, char *buf,
     size_t *rsize)
+{
+	struct bcache_devdata bcd;
+	struct devdesc *dev;
+
+	dev = (struct devdesc *)devdata;
+	if (dev == NULL)
+		return (EINVAL);
+	bcd.dv_strategy = efipart_realstrategy;
+	bcd.dv_devdata = devdata;
+	bcd.dv_flags = 0;	/* USB sticks claim to be removable, cache anyway */
+	return (bcache_strategy(&bcd, dev->d_unit, rw, blk, size, buf, rsize));
+}
+
+static int
+efipart_realstrategy(void *devdata, int rw, daddr_t blk, size_t size,
+    char *buf, size_t *rsize)
 {
 	struct devdesc *dev = (struct devdesc *)devdata;
 	EFI_BLOCK_IO *blkio;
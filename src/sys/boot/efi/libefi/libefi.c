@@ -39,6 +39,14 @@ EFI_RUNTIME_SERVICES	*RS;
 
 static EFI_PHYSICAL_ADDRESS heap;
 static UINTN heapsize;
+
+/*
+ * The heap always gets EFI_HEAP_MIN bytes for the loader proper.  When
+ * the firmware has plenty of conventional memory the heap is grown (up
+ * to EFI_HEAP_MAX) so the disk block cache can be sized to match.
+ */
+#define	EFI_HEAP_MIN	(3 * 1024 * 1024)
+#define	EFI_HEAP_MAX	(64 * 1024 * 1024)
 /* XXX recheck .S if really void */
 void efi_main(EFI_HANDLE Ximage, EFI_SYSTEM_TABLE* Xsystab);
 
@@ -74,6 +82,62 @@ efi_get_table(EFI_GUID *tbl)
 	return (NULL);
 }
 
+/*
+ * Pick a heap size from the amount of free conventional memory the
+ * firmware reports, using 1/16th of it but never less than EFI_HEAP_MIN
+ * or more than EFI_HEAP_MAX.  The memory map buffer comes from the
+ * firmware pool since our own heap does not exist yet.
+ */
+static UINTN
+efi_heap_size_probe(void)
+{
+	EFI_MEMORY_DESCRIPTOR *map, *p;
+	EFI_STATUS status;
+	UINTN sz, key, dsz, avail, size;
+	UINT32 dver;
+	UINTN i, ndesc;
+
+	sz = 0;
+	status = BS->GetMemoryMap(&sz, NULL, &key, &dsz, &dver);
+	if (status != EFI_BUFFER_TOO_SMALL)
+		return (EFI_HEAP_MIN);
+	sz += 4 * dsz;		/* the pool allocation may add entries */
+	status = BS->AllocatePool(EfiLoaderData, sz, (VOID **)&map);
+	if (EFI_ERROR(status))
+		return (EFI_HEAP_MIN);
+	status = BS->GetMemoryMap(&sz, map, &key, &dsz, &dver);
+	if (EFI_ERROR(status)) {
+		BS->FreePool(map);
+		return (EFI_HEAP_MIN);
+	}
+
+	avail = 0;
+	ndesc = sz / dsz;
+	for (i = 0, p = map; i < ndesc; i++, p = NextMemoryDescriptor(p, dsz)) {
+		if (p->Type == EfiConventionalMemory)
+			avail += p->NumberOfPages * EFI_PAGE_SIZE;
+	}
+	BS->FreePool(map);
+
+	size = avail / 16;
+	if (size < EFI_HEAP_MIN)
+		size = EFI_HEAP_MIN;
+	if (size > EFI_HEAP_MAX)
+		size = EFI_HEAP_MAX;
+	return (size);
+}
+
+/*
+ * Return the number of heap bytes available beyond what the loader
+ * itself is expected to need.  Used to size the disk block cache.
+ */
+UINTN
+efi_heap_spare(void)
+{
+
+	return (heapsize - EFI_HEAP_MIN);
+}
+
 void exit(EFI_STATUS exit_code)
 {
 
@@ -106,9 +170,14 @@ efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 		(void)console_control->SetMode(console_control,
 		    EfiConsoleControlScreenText);
 
-	heapsize = 3 * 1024 * 1024;
+	heapsize = efi_heap_size_probe();
 	status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
 	    EFI_SIZE_TO_PAGES(heapsize), &heap);
+	if (status != EFI_SUCCESS && heapsize > EFI_HEAP_MIN) {
+		heapsize = EFI_HEAP_MIN;
+		status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+		    EFI_SIZE_TO_PAGES(heapsize), &heap);
+	}
 	if (status != EFI_SUCCESS)
 		BS->Exit(IH, status, 0, NULL);
 
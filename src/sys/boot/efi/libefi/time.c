@@ -48,6 +48,7 @@ __FBSDID("$FreeBSD: head/sys/boot/efi/libefi/time.c 295869 2016-02-21 21:20:23Z
 #include <sys/time.h>
 
 extern time_t getsecs(void);
+extern u_int getmsecs(void);
 
 /*
 // Accurate only for the past couple of centuries;
@@ -226,3 +227,56 @@ getsecs(void)
 {
 	return time(0);
 }
+
+/*
+ * GetTime() only gives us whole seconds on most firmware, which is far
+ * too coarse to time network round trips.  Count milliseconds with a
+ * periodic 10ms timer event instead, set up on first use.  If the
+ * firmware won't give us one we fall back to the seconds clock.
+ */
+static EFI_EVENT	msec_event;
+static int		msec_failed;
+static volatile u_int	msec_ticks;
+
+static VOID EFIAPI
+msec_tick(EFI_EVENT ev __unused, VOID *ctx __unused)
+{
+	msec_ticks++;
+}
+
+u_int
+getmsecs(void)
+{
+	EFI_EVENT ev;
+
+	if (msec_event == NULL && !msec_failed) {
+		if (BS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+		    msec_tick, NULL, &ev) != EFI_SUCCESS) {
+			msec_failed = 1;
+		} else if (BS->SetTimer(ev, TimerPeriodic, 100000) !=
+		    EFI_SUCCESS) {
+			BS->CloseEvent(ev);
+			msec_failed = 1;
+		} else {
+			msec_event = ev;
+		}
+	}
+	if (msec_event == NULL)
+		return (getsecs() * 1000);
+	return (msec_ticks * 10);
+}
+
+/*
+ * Tear down the millisecond timer; must be done before we exit boot
+ * services.
+ */
+void
+efi_time_fini(void)
+{
+	if (msec_event != NULL) {
+		BS->SetTimer(msec_event, TimerCancel, 0);
+		BS->CloseEvent(msec_event);
+		msec_event = NULL;
+	}
+	msec_failed = 1;
+}
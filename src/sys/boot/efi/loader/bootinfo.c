@@ -260,6 +260,9 @@ bi_load_efi_data(struct preloaded_file *kfp)
 
 	efisz = (sizeof(struct efi_map_header) + 0xf) & ~0xf;
 
+	/* Our timer event must not fire once boot services are gone. */
+	efi_time_fini();
+
 	/*
 	 * It is possible that the first call to ExitBootServices may change
 	 * the map key. Fetch a new map key and retry ExitBootServices in that
@@ -306,6 +309,7 @@ bi_load_efi_data(struct preloaded_file *kfp)
 		}
 		status = BS->ExitBootServices(IH, efi_mapkey);
 		if (EFI_ERROR(status) == 0) {
+			boot_services_gone = 1;
 			efihdr->memory_size = sz;
 			efihdr->descriptor_size = mmsz;
 			efihdr->descriptor_version = mmver;
@@ -340,6 +344,8 @@ bi_load(char *args, vm_offset_t *modulep, vm_offset_t *kernendp)
 	vm_offset_t size;
 	char *rootdevname;
 	int howto;
+	UINTN mapsz, mapkey, descsz;
+	UINT32 descver;
 
 	howto = bi_getboothowto(args);
 
@@ -385,6 +391,21 @@ bi_load(char *args, vm_offset_t *modulep, vm_offset_t *kernendp)
 	file_addmetadata(kfp, MODINFOMD_KERNEND, sizeof kernend, &kernend);
 	file_addmetadata(kfp, MODINFOMD_FW_HANDLE, sizeof ST, &ST);
 
+	/*
+	 * The staging area can't grow once boot services are gone, so make
+	 * room for the metadata now.  The memory map and framebuffer
+	 * entries bi_load_efi_data() adds are not there yet; leave twice
+	 * the current map size and a few pages for them.
+	 */
+	mapsz = 0;
+	BS->GetMemoryMap(&mapsz, NULL, &mapkey, &descsz, &descver);
+	size = bi_copymodules(0) + 2 * mapsz + 4 * EFI_PAGE_SIZE;
+	if (efi_copy_reserve(addr, size) != 0) {
+		printf("no room for %lu bytes of metadata at 0x%lx\n",
+		    (u_long)size, (u_long)addr);
+		return (ENOMEM);
+	}
+
 	bi_load_efi_data(kfp);
 
 	/* Figure out the size and location of the metadata. */
@@ -39,29 +39,48 @@ __FBSDID("$FreeBSD: head/sys/boot/efi/loader/copy.c 293724 2016-01-12 02:17:39Z
 
 #include "loader_efi.h"
 
+/*
+ * The kernel and modules are loaded straight to their final physical
+ * address when the firmware lets us allocate it.  Otherwise they go to a
+ * staging area and efi_copy_finish() moves them there on the way to the
+ * kernel.  Either area starts out as a single EFI_STAGING_CHUNK and grows
+ * in chunks as the kernel and modules are loaded, up to EFI_STAGING_SIZE.
+ * Both are in MB.
+ */
 #ifndef EFI_STAGING_SIZE
 #define	EFI_STAGING_SIZE	96
 #endif
 
+#ifndef EFI_STAGING_CHUNK
+#define	EFI_STAGING_CHUNK	16
+#endif
+
 #define	STAGE_PAGES	EFI_SIZE_TO_PAGES((EFI_STAGING_SIZE) * 1024 * 1024)
+#define	STAGE_CHUNK	EFI_SIZE_TO_PAGES((EFI_STAGING_CHUNK) * 1024 * 1024)
 
 EFI_PHYSICAL_ADDRESS	staging, staging_end;
 int			stage_offset_set = 0;
 ssize_t			stage_offset;
+static size_t		stage_used;	/* high-water mark above staging */
+static int		stage_direct;	/* staging is the final address */
+int			boot_services_gone;	/* set by bi_load_efi_data() */
 
 int
 efi_copy_init(void)
 {
 	EFI_STATUS	status;
-	size_t		pages = STAGE_PAGES;
+	size_t		pages = STAGE_CHUNK;
 
+	if (pages > STAGE_PAGES)
+		pages = STAGE_PAGES;
 	status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
 	    pages, &staging);
 	if (EFI_ERROR(status)) {
-		printf("failed to allocate %uMB staging area: %lu\n",
-		    EFI_STAGING_SIZE, EFI_ERROR_CODE(status));
-		printf("retrying with smaller %uMB allocation\n",
-		    EFI_STAGING_SIZE/2);
+		printf("failed to allocate %luMB staging area: %lu\n",
+		    (u_long)pages * EFI_PAGE_SIZE / (1024 * 1024),
+		    EFI_ERROR_CODE(status));
+		printf("retrying with smaller %luMB allocation\n",
+		    (u_long)(pages / 2) * EFI_PAGE_SIZE / (1024 * 1024));
 		pages /= 2;
 		status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
 		    pages, &staging);
@@ -72,32 +91,161 @@ efi_copy_init(void)
 		return (status);
 	}
 	staging_end = staging + pages * EFI_PAGE_SIZE;
+	stage_used = 0;
 
 	return (0);
 }
 
-void *
-efi_translate(vm_offset_t ptr)
+/*
+ * Make the staging area reach at least (end).  Extend it in place if the
+ * pages above it are free, otherwise move everything loaded so far to a
+ * larger allocation.  Once boot services are gone there is no growing;
+ * bi_load() reserves what it needs before that.
+ */
+static int
+efi_copy_grow(EFI_PHYSICAL_ADDRESS end)
 {
+	EFI_PHYSICAL_ADDRESS	nstaging;
+	EFI_STATUS		status;
+	size_t			pages, npages;
 
-	return ((void *)(ptr + stage_offset));
+	if (boot_services_gone)
+		return (-1);
+	pages = EFI_SIZE_TO_PAGES(staging_end - staging);
+	npages = roundup(EFI_SIZE_TO_PAGES(end - staging), STAGE_CHUNK);
+	if (npages > STAGE_PAGES)
+		npages = STAGE_PAGES;
+	if (staging + npages * EFI_PAGE_SIZE < end)
+		return (-1);
+
+	/*
+	 * A direct load can only grow in place, so try for just what is
+	 * needed before giving up on it.
+	 */
+	nstaging = staging_end;
+	status = BS->AllocatePages(AllocateAddress, EfiLoaderData,
+	    npages - pages, &nstaging);
+	if (EFI_ERROR(status) && stage_direct) {
+		npages = EFI_SIZE_TO_PAGES(end - staging);
+		nstaging = staging_end;
+		status = BS->AllocatePages(AllocateAddress, EfiLoaderData,
+		    npages - pages, &nstaging);
+	}
+	if (!EFI_ERROR(status)) {
+		staging_end = staging + npages * EFI_PAGE_SIZE;
+		return (0);
+	}
+
+	status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+	    npages, &nstaging);
+	if (EFI_ERROR(status)) {
+		printf("failed to grow staging area to %luMB: %lu\n",
+		    (u_long)npages * EFI_PAGE_SIZE / (1024 * 1024),
+		    EFI_ERROR_CODE(status));
+		return (-1);
+	}
+	if (stage_direct) {
+		printf("load address 0x%lx busy, using staging area\n",
+		    (u_long)staging_end);
+		stage_direct = 0;
+	}
+	bcopy((void *)staging, (void *)nstaging, stage_used);
+	BS->FreePages(staging, pages);
+	stage_offset += nstaging - staging;
+	staging = nstaging;
+	staging_end = staging + npages * EFI_PAGE_SIZE;
+	return (0);
 }
 
-ssize_t
-efi_copyin(const void *src, vm_offset_t dest, const size_t len)
+/*
+ * Try to claim the final physical address of the first thing loaded,
+ * at (dest), for the staging area so nothing has to be copied at exec
+ * time.  The area set up by efi_copy_init() is given back if it works.
+ */
+static void
+efi_copy_direct(vm_offset_t dest, size_t len)
 {
+	EFI_PHYSICAL_ADDRESS	base;
+	EFI_STATUS		status;
+	size_t			pages;
+
+	if (boot_services_gone)
+		return;
+	base = dest & ~(EFI_PHYSICAL_ADDRESS)EFI_PAGE_MASK;
+	pages = roundup(EFI_SIZE_TO_PAGES(dest + len - base), STAGE_CHUNK);
+	if (pages > STAGE_PAGES)
+		pages = STAGE_PAGES;
+	status = BS->AllocatePages(AllocateAddress, EfiLoaderData,
+	    pages, &base);
+	if (EFI_ERROR(status)) {
+		base = dest & ~(EFI_PHYSICAL_ADDRESS)EFI_PAGE_MASK;
+		pages = EFI_SIZE_TO_PAGES(dest + len - base);
+		status = BS->AllocatePages(AllocateAddress, EfiLoaderData,
+		    pages, &base);
+	}
+	if (EFI_ERROR(status))
+		return;
+
+	BS->FreePages(staging, EFI_SIZE_TO_PAGES(staging_end - staging));
+	staging = base;
+	staging_end = base + pages * EFI_PAGE_SIZE;
+	stage_direct = 1;
+}
+
+/*
+ * Check that [dest, dest + len) can be staged, growing the staging area
+ * if need be.
+ */
+int
+efi_copy_reserve(vm_offset_t dest, size_t len)
+{
+	EFI_PHYSICAL_ADDRESS	start, end;
 
 	if (!stage_offset_set) {
-		stage_offset = (vm_offset_t)staging - dest;
+		efi_copy_direct(dest, len);
+		stage_offset = stage_direct ? 0 : (vm_offset_t)staging - dest;
 		stage_offset_set = 1;
 	}
 
-	/* XXX: Callers do not check for failure. */
-	if (dest + stage_offset + len > staging_end) {
+	start = dest + stage_offset;
+	end = start + len;
+	if (start < staging || end < start) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	if (end > staging_end && efi_copy_grow(end) != 0) {
 		errno = ENOMEM;
 		return (-1);
 	}
+	return (0);
+}
+
+static void
+efi_copy_used(vm_offset_t dest, size_t len)
+{
+	size_t		used;
+
+	used = dest + stage_offset + len - staging;
+	if (used > stage_used)
+		stage_used = used;
+}
+
+void *
+efi_translate(vm_offset_t ptr)
+{
+
+	return ((void *)(ptr + stage_offset));
+}
+
+ssize_t
+efi_copyin(const void *src, vm_offset_t dest, const size_t len)
+{
+
+	/* XXX: Callers do not check for failure. */
+	if (efi_copy_reserve(dest, len) != 0)
+		return (-1);
 	bcopy(src, (void *)(dest + stage_offset), len);
+	efi_copy_used(dest, len);
 	return (len);
 }
 
@@ -118,23 +266,27 @@ efi_copyout(const vm_offset_t src, void *dest, const size_t len)
 ssize_t
 efi_readin(const int fd, vm_offset_t dest, const size_t len)
 {
+	ssize_t		got;
 
-	if (dest + stage_offset + len > staging_end) {
-		errno = ENOMEM;
+	if (efi_copy_reserve(dest, len) != 0)
 		return (-1);
-	}
-	return (read(fd, (void *)(dest + stage_offset), len));
+	got = read(fd, (void *)(dest + stage_offset), len);
+	if (got > 0)
+		efi_copy_used(dest, got);
+	return (got);
 }
 
+/*
+ * Move what was loaded to where the kernel expects it.  Only the part of
+ * the staging area that was actually written is copied; the destination
+ * may overlap it.
+ */
 void
 efi_copy_finish(void)
 {
-	uint64_t	*src, *dst, *last;
-
-	src = (uint64_t *)staging;
-	dst = (uint64_t *)(staging - stage_offset);
-	last = (uint64_t *)staging_end;
 
-	while (src < last)
-		*dst++ = *src++;
+	if (stage_offset == 0 || stage_used == 0)
+		return;
+	memmove((void *)(staging - stage_offset), (void *)staging,
+	    stage_used);
 }
@@ -40,6 +40,9 @@ char	*efi_fmtdev(void *vdev);
 int	efi_setcurrdev(struct env_var *ev, int flags, const void *value);
 
 int	efi_copy_init(void);
+int	efi_copy_reserve(vm_offset_t dest, size_t len);
+
+extern int boot_services_gone;
 
 ssize_t	efi_copyin(const void *src, vm_offset_t dest, const size_t len);
 ssize_t	efi_copyout(const vm_offset_t src, void *dest, const size_t len);
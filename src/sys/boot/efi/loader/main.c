@@ -88,6 +88,29 @@ cp16to8(const CHAR16 *src, char *dst, size_t len)
 		dst[i] = (char)src[i];
 }
 
+/*
+ * Size the disk block cache from the spare heap libefi reserved based on
+ * the amount of conventional memory, keeping a floor of 32 blocks so the
+ * cache still works on machines where the heap could not be grown.
+ */
+#define	EFI_BCACHE_BSIZE	512
+#define	EFI_BCACHE_MINBLKS	32
+
+static void
+efi_bcache_init(void)
+{
+	u_int nblks;
+
+	nblks = efi_heap_spare() / 2 / EFI_BCACHE_BSIZE;
+	if (nblks < EFI_BCACHE_MINBLKS)
+		nblks = EFI_BCACHE_MINBLKS;
+	while (bcache_init(nblks, EFI_BCACHE_BSIZE) != 0) {
+		if (nblks <= EFI_BCACHE_MINBLKS)
+			return;
+		nblks /= 2;
+	}
+}
+
 static int
 has_keyboard(void)
 {
@@ -184,6 +207,7 @@ main(int argc, CHAR16 *argv[])
 
 	archsw.arch_autoload = efi_autoload;
 	archsw.arch_getdev = efi_getdev;
+	archsw.arch_fmtdev = efi_fmtdev;
 	archsw.arch_copyin = efi_copyin;
 	archsw.arch_copyout = efi_copyout;
 	archsw.arch_readin = efi_readin;
@@ -294,6 +318,11 @@ main(int argc, CHAR16 *argv[])
 		return (EFI_BUFFER_TOO_SMALL);
 	}
 
+	/*
+	 * Initialise the block cache
+	 */
+	efi_bcache_init();
+
 	/*
 	 * March through the device switch probing for things.
 	 */
@@ -198,6 +198,7 @@ bc_open(struct open_file *f, ...)
 		DEBUG("attempt to open nonexistent disk");
 		return(ENXIO);
 	}
+	f->f_flags |= F_VOLATILE;
 
 	return(0);
 }
@@ -306,6 +306,8 @@ bd_open(struct open_file *f, ...)
 
 	if (dev->d_unit < 0 || dev->d_unit >= nbdinfo)
 		return (EIO);
+	if (BD(dev).bd_flags & BD_FLOPPY)
+		f->f_flags |= F_VOLATILE;
 
 	err = disk_open(dev, BD(dev).bd_sectors * BD(dev).bd_sectorsize,
 	    BD(dev).bd_sectorsize, (BD(dev).bd_flags & BD_FLOPPY) ?
@@ -353,6 +355,7 @@ bd_strategy(void *devdata, int rw, daddr_t dblk, size_t size, char *buf,
 	dev = (struct disk_devdesc *)devdata;
 	bcd.dv_strategy = bd_realstrategy;
 	bcd.dv_devdata = devdata;
+	bcd.dv_flags = (BD(dev).bd_flags & BD_FLOPPY) ? BCACHE_F_VOLATILE : 0;
 	return (bcache_strategy(&bcd, BD(dev).bd_unit, rw, dblk + dev->d_offset,
 	    size, buf, rsize));
 }
@@ -423,6 +426,17 @@ bd_realstrategy(void *devdata, int rw, daddr_t dblk, size_t size, char *buf,
 /* Max number of sectors to bounce-buffer if the request crosses a 64k boundary */
 #define FLOPPY_BOUNCEBUF	18
 
+/* Max bytes per EDD packet transfer; 127 sectors, and stay within 64k */
+#define EDD_MAXXFER		(127 * 512)
+
+/*
+ * Bounce buffer for EDD transfers to memory the BIOS can't reach, eg.
+ * the block cache in the high heap.  Like the rest of our data it lives
+ * below 1MB, and it is large enough that coalesced and read-ahead
+ * requests still go to the BIOS as a few big transfers.
+ */
+static char	bd_eddbuf[EDD_MAXXFER];
+
 static int
 bd_edd_io(struct disk_devdesc *dev, daddr_t dblk, int blks, caddr_t dest,
     int write)
@@ -496,7 +510,15 @@ bd_io(struct disk_devdesc *dev, daddr_t dblk, int blks, caddr_t dest, int write)
     p = dest;
 
     /* Decide whether we have to bounce */
-    if (VTOP(dest) >> 20 != 0 || ((BD(dev).bd_unit < 0x80) &&
+    if (VTOP(dest) >> 20 != 0 && (BD(dev).bd_flags & BD_MODEEDD1) &&
+	BD(dev).bd_unit >= 0x80 && BD(dev).bd_sectorsize <= sizeof(bd_eddbuf)) {
+	/*
+	 * Hard disks have no 64k DMA boundary to avoid, so the static
+	 * buffer will do.
+	 */
+	breg = bbuf = bd_eddbuf;
+	maxfer = sizeof(bd_eddbuf) / BD(dev).bd_sectorsize;
+    } else if (VTOP(dest) >> 20 != 0 || ((BD(dev).bd_unit < 0x80) &&
 	((VTOP(dest) >> 16) != (VTOP(dest +
 	blks * BD(dev).bd_sectorsize) >> 16)))) {
 
@@ -524,11 +546,16 @@ bd_io(struct disk_devdesc *dev, daddr_t dblk, int blks, caddr_t dest, int write)
 
     while (resid > 0) {
 	/*
-	 * Play it safe and don't cross track boundaries.
-	 * (XXX this is probably unnecessary)
+	 * EDD addresses by LBA, so only the transfer size limit of the
+	 * packet interface applies.  For CHS play it safe and don't
+	 * cross track boundaries.
 	 */
-	sec = dblk % BD(dev).bd_sec;	/* offset into track */
-	x = szmin(BD(dev).bd_sec - sec, resid);
+	if (BD(dev).bd_flags & BD_MODEEDD1) {
+	    x = szmin(EDD_MAXXFER / BD(dev).bd_sectorsize, resid);
+	} else {
+	    sec = dblk % BD(dev).bd_sec;	/* offset into track */
+	    x = szmin(BD(dev).bd_sec - sec, resid);
+	}
 	if (maxfer > 0)
 	    x = szmin(x, maxfer);		/* fit bounce buffer */
 
@@ -237,6 +237,9 @@ pxe_init(void)
 	}
 	bcopy(PTOV((gci_p->Buffer.segment << 4) + gci_p->Buffer.offset),
 	      &bootplayer, gci_p->BufferSize);
+
+	/* readudp() can't take datagrams larger than data_buffer */
+	udp_maxdata = sizeof(data_buffer);
 	return (1);
 }
 
@@ -415,7 +418,8 @@ pxe_perror(int err __unused)
 struct nfs_iodesc {
 	struct	iodesc	*iodesc;
 	off_t	off;
-	u_char	fh[NFS_FHSIZE];
+	u_char	fh[NFS_V3MAXFHSIZE];
+	int	fhsize;
 	/* structure truncated here */
 };
 extern struct	nfs_iodesc nfs_root_node;
@@ -425,7 +429,7 @@ pxe_setnfshandle(char *rp __unused)
 {
 	int	i;
 	u_char	*fh;
-	char	buf[2 * NFS_FHSIZE + 3], *cp;
+	char	buf[2 * NFS_V3MAXFHSIZE + 3], *cp;
 
 	fh = &nfs_root_node.fh[0];
 
@@ -433,17 +437,19 @@ pxe_setnfshandle(char *rp __unused)
 	 * If no file handle exists but a root path was dynamically
 	 * requested, try to get a good handle.
 	 */
-	for (i = 0; i < NFS_FHSIZE; ++i) {
+	for (i = 0; i < nfs_root_node.fhsize; ++i) {
 		if (fh[i])
 			break;
 	}
-	if (i != NFS_FHSIZE) {
+	if (i != nfs_root_node.fhsize) {
 		buf[0] = 'X';
 		cp = &buf[1];
-		for (i = 0; i < NFS_FHSIZE; i++, cp += 2)
+		for (i = 0; i < nfs_root_node.fhsize; i++, cp += 2)
 			sprintf(cp, "%02x", fh[i]);
 		sprintf(cp, "X");
 		setenv("boot.nfsroot.nfshandle", buf, 1);
+		sprintf(buf, "%d", nfs_root_node.fhsize);
+		setenv("boot.nfsroot.nfshandlelen", buf, 1);
 	}
 }
 
@@ -502,6 +508,27 @@ getsecs(void)
 	return n;
 }
 
+/*
+ * Milliseconds, from the BIOS tick count at 0x46c.  It runs at 18.2Hz so
+ * this moves in steps of about 55ms, which is still a lot better than
+ * the RTC seconds for timing round trips.  The count restarts at
+ * midnight; carry on from where we were rather than going backwards.
+ */
+#define	BIOS_TICKS_PER_DAY	0x1800b0
+
+u_int
+getmsecs(void)
+{
+	static u_int32_t lastticks, days;
+	u_int32_t ticks;
+
+	ticks = *(volatile u_int32_t *)PTOV(0x46c);
+	if (ticks < lastticks)
+		days++;
+	lastticks = ticks;
+	return ((days * BIOS_TICKS_PER_DAY + ticks) * 55);
+}
+
 static int
 pxe_netif_match(struct netif *nif __unused, void *machdep_hint __unused)
 {
@@ -600,9 +627,11 @@ readudp(struct iodesc *h, void *pkt, size_t len, time_t timeout __unused)
 	t_PXENV_UDP_READ *udpread_p = (t_PXENV_UDP_READ *)scratch_buffer;
 	struct udphdr *uh;
 	struct ip *ip;
+	size_t bufsize;
 
 	uh = (struct udphdr *) pkt - 1;
 	ip = (struct ip *)uh - 1;
+	bufsize = len < sizeof(data_buffer) ? len : sizeof(data_buffer);
 again:
 	bzero(udpread_p, sizeof(*udpread_p));
 
@@ -616,7 +645,7 @@ again:
 	else
 		udpread_p->dest_ip = h->myip.s_addr;
 	udpread_p->d_port         = h->myport;
-	udpread_p->buffer_size    = len;
+	udpread_p->buffer_size    = bufsize;
 	udpread_p->buffer.segment = VTOPSEG(data_buffer);
 	udpread_p->buffer.offset  = VTOPOFF(data_buffer);
 
@@ -645,6 +674,10 @@ again:
 		}
 	}
 
+	/* Drop datagrams that didn't fit rather than pass on a piece. */
+	if (udpread_p->buffer_size > bufsize)
+		return -1;
+
 	bcopy(data_buffer, pkt, udpread_p->buffer_size);
 	uh->uh_sport = udpread_p->s_port;
 	ip->ip_src.s_addr = udpread_p->src_ip;
@@ -92,6 +92,7 @@ static struct bootinfo	*initial_bootinfo;
 struct arch_switch	archsw;		/* MI/MD interface boundary */
 
 static void		extract_currdev(void);
+static void		i386_bcache_init(void);
 static int		isa_inb(int port);
 static void		isa_outb(int port, int value);
 void			exit(int code);
@@ -132,6 +133,35 @@ WDEBUG(char c)
 
 #endif
 
+/*
+ * Size the disk block cache from the heap, taking an eighth of it (at
+ * most 4MB) so bzip2 and the rest of the loader keep the bulk.  That is
+ * the high heap when there is one and base memory otherwise.  If the
+ * allocation fails, halve down to a 16k cache.
+ */
+#define	I386_BCACHE_BSIZE	512
+#define	I386_BCACHE_MINBLKS	32
+#define	I386_BCACHE_MAXBLKS	8192
+
+static void
+i386_bcache_init(void)
+{
+    u_int	nblks;
+
+    nblks = ((char *)heap_top - (char *)heap_bottom) / 8 / I386_BCACHE_BSIZE;
+    if (nblks > I386_BCACHE_MAXBLKS)
+	nblks = I386_BCACHE_MAXBLKS;
+    if (nblks < I386_BCACHE_MINBLKS)
+	nblks = I386_BCACHE_MINBLKS;
+    while (bcache_init(nblks, I386_BCACHE_BSIZE) != 0) {
+	if (nblks <= I386_BCACHE_MINBLKS) {
+	    printf("failed to allocate disk block cache\n");
+	    return;
+	}
+	nblks /= 2;
+    }
+}
+
 int
 main(void)
 {
@@ -225,7 +255,7 @@ main(void)
     /*
      * Initialise the block cache
      */
-    bcache_init(32, 512);	/* 16k cache XXX tune this */
+    i386_bcache_init();
 
     /*
      * Special handling for PXE and CD booting.
@@ -243,6 +273,7 @@ main(void)
 
     archsw.arch_autoload = i386_autoload;
     archsw.arch_getdev = i386_getdev;
+    archsw.arch_fmtdev = i386_fmtdev;
     archsw.arch_copyin = i386_copyin;
     archsw.arch_copyout = i386_copyout;
     archsw.arch_readin = i386_readin;
@@ -380,6 +411,16 @@ command_reboot(int argc __unused, char *argv[] __unused)
     __exit(0);
 }
 
+COMMAND_SET(hammerstat, "hammerstat", "show HAMMER cache statistics",
+    command_hammerstat);
+
+static int
+command_hammerstat(int argc __unused, char *argv[] __unused)
+{
+    hammerstats();
+    return(CMD_OK);
+}
+
 /* provide this for panic, as it's not in the startup code */
 void
 exit(int code)